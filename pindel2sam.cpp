@@ -16,18 +16,35 @@
  *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
  ****
  *
- * Args: <pindel data directory> <output directory> config_file fafai_file
+ * Args: <pindel data directory> <output directory> config_file fafai_file [options]
+ *  --format sam|bam	output text SAM (default) or BGZF-compressed BAM
+ *  --sort		write coordinate-sorted <output>.sorted.sam|bam instead, sorted BAM is also indexed (.bai or .csi)
+ *  --sort-memory MiB	memory for sorting before runs are spilled to disk, or for unsorted write buffers (default 768)
+ *  --threads N		BGZF compression threads shared by all outputs, and parse threads unless --parse-threads is given (default 0)
+ *  --level 0-9		BGZF compression level (default 6, 0 stores, 1 is fastest)
+ *  --parse-threads N	threads converting pieces of the Pindel files (default --threads, 0 converts on the main thread)
+ *  --finalize-threads N	outputs sorted, written and indexed at once at the end (default --threads, at least 1)
+ *  --open-outputs N	output files kept open at once, the least recently written is closed and reopened for appending (default half the descriptor limit)
+ *  --index		write an event index (<pindel file>.p2si) next to each Pindel file and stop
+ *  --region chr[:start-end]	convert only events with BPLeft_plus_one in the region, may be repeated
+ *  --regions file.bed	convert only events in the BED regions, seeking with the event index (made if missing)
+ *  --serve socket	answer "<sample or output> chr:start-end" lines on a unix socket with sorted BAM slices, until "quit"
+ *  --cache-memory MiB	memory for events converted by --serve (default 256)
+ *  --cache dir		keep what each Pindel file adds to the outputs in dir, and reuse it while the file, config, fai and options are unchanged
+ *  --shard		write each output as coordinate-sorted shards <output>.<chr>.sorted.sam|bam listed in pin2sam.shards (implies --sort)
+ *  --merge name		write every sample to one output <name>.sam|bam, with an @RG line per sample and an RG:Z tag on each read
  * 
- * Description: Converts Pindel data files (_D & _SI) into SAM format.
+ * Description: Converts Pindel data files (_D & _SI, or gzip/bgzip compressed _D.gz & _SI.gz) into SAM or BAM format.
  * 
  * NOTES: 
  *  dirent.h taken from users.cis.fiu.edu/~weiss/cop4338_spr06/dirent.h.
  *  Make sure that the output directory does not contain any previously generated output files.
- *  Any files ending with _D or _SI in the pindel data directory will be read.
+ *  Unsorted runs keep a checkpoint (pin2sam.checkpoint) in the output directory, a killed run continues from it when restarted.
+ *  Any files ending with _D, _SI, _D.gz or _SI.gz in the pindel data directory will be read, largest first.
  *  Sub directories are not checked for input.
  *  One must create any directory path included with the samples listed in the config file before converting.
  *  Filler data is written for FLAG, MAPQ, RNEXT, PNEXT, TLEN, and QUAL for each read.
- *  After running, convert output SAM files to BAM, then sort and index the BAM files.
+ *  After running, convert output SAM files to BAM (unless --format bam), then sort and index the BAM files.
  *  The BAM files listed in the first column of the config_file are the basis for each of the output SAM files.
  *  All _D & _SI supports are listed in corresponding output files.
  */
@@ -717,12 +734,35 @@ _setdirname (struct DIR *dirp) {
 
 /* pindel2sam */ 
 #include <cstdlib>
+#include <cstring>
+#include <cerrno>
 #include <sstream>
+#include <iomanip>
 #include <iostream>
 #include <fstream>
 //#include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <functional>
+#include <deque>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <list>
+#include <zlib.h>
+
+#if defined(__GNUC__) && ( __GNUC__ > 4 || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 ) ) && ( defined(__x86_64__) || defined(__i386__) )
+#define PINDEL2SAM_SIMD //SSE4.2 and AVX2 scanners, chosen at run time
+#include <immintrin.h>
+#endif
 
 //#include <dirent.h>
 
@@ -733,195 +773,773 @@ const int NUMBEROFPOUNDS = 100;
 const int NUMBEROFSUMMARYFIELDS = 31;
 const int NUMBEROFSUMMARYSAMPLEFIELDS = 7;
 const int UPDATEFREQUENCY = 10000;
+const size_t OUTPUTBUFFERSIZE = 4*1024*1024; //bytes held per output before a write
+const size_t BGZFBLOCKSIZE = 0xff00; //uncompressed bytes per BGZF block, as in htslib
+const int INDEXMINSHIFT = 14; //16 kbp linear index windows
+const int BAILEVELS = 5; //BAI covers references up to 512 Mbp, longer ones need CSI
+const int LONGREFERENCEBIN = 4680; //reg2bin(-1,0), the BAM bin of records on references BAI bins do not cover
+const int JOBSPERTHREAD = 8; //BGZF blocks queued per compression thread before the converter waits
+const size_t CHUNKSIZE = 16*1024*1024; //bytes of Pindel file per piece converted by a parse thread
+const int MAXOPENOUTPUTS = 4096; //default limit on open output files when the descriptor limit is higher
+const int CHUNKSPERTHREAD = 2; //converted pieces held per parse thread while waiting to be written in order
+const size_t INFLATESIZE = 1024*1024; //bytes of text inflated at a time from gzip inputs
+const size_t ARENABLOCKSIZE = 64*1024; //bytes per block of an event arena, longer requests get a block of their own
+const size_t INDEXGROUPSIZE = 64*1024; //bytes of events of one chromosome per event index entry
+const std::string EVENTINDEXSUFFIX = ".p2si";
+const int SERVEMARGIN = 10000; //bp left of a served region searched for events whose reads reach into it
+const size_t SERVEREQUESTSIZE = 4096; //longest request line
+const uint64_t CHECKPOINTINTERVAL = 64*1024*1024; //bytes of Pindel file converted between checkpoints
+const std::string CHECKPOINTFILENAME = "pin2sam.checkpoint";
+const int FRAGMENTVERSION = 1; //bump when the records written for an event change
+const std::string FRAGMENTSUFFIX = ".p2sf";
+const std::string FINGERPRINTFILENAME = "pin2sam.fingerprints";
+const std::string SHARDMANIFESTNAME = "pin2sam.shards";
+const std::string BAMCIGAROPS = "MIDNSHP=X";
+const int MAXCIGAROPS = 4; //M I D M of a complex indel
+const int SAMFLAG = 2; //filler value
+const int SAMMAPQ = 60; //filler value
+const std::string SAMMAPQCOLUMN = "\t60\t"; //between POS and CIGAR
+const std::string SAMMATECOLUMNS = "\t*\t0\t0\t"; //RNEXT PNEXT TLEN, between CIGAR and SEQ: single reads, mate unknown
+const std::string SAMTAILCOLUMNS = "\t*\tPG:Z:Pindel"; //QUAL not stored, then the optional fields
+const std::string BAMTAG = "PGZPindel"; //the same tag encoded for BAM, without its NUL
+const int CIGARDELETION = 0; //pack_CIGAR variants
+const int CIGARINSERTION = 1;
+const int CIGARCOMPLEX = 2; //deletion with inserted NT
+const std::string BAMSEQCODES = "=ACMGRSVTWYHKDBN";
 int NUMBEROFSAMPLES;
-int linenum = 0;
-int value = 0; //use for error values
 std::string outputDirectoryName = "";
-
+std::string outputFormat = "sam"; //sam or bam
+bool sortOutput = false;
+size_t sortMemory = 768*1024*1024; //bytes of records held for sorting before spilling
+size_t sortMemoryUsed = 0;
+size_t bufferMemoryUsed = 0; //bytes in the buffers of unsorted outputs, kept under sortMemory by flush_buffers
+int numberOfThreads = 0; //compression threads
+int compressionLevel = Z_DEFAULT_COMPRESSION;
+int parseThreads = -1; //threads converting pieces of the Pindel files, numberOfThreads unless set
+int finalizeThreads = -1; //threads finishing the outputs, numberOfThreads (at least 1) unless set
+int maxOpenOutputs = 0; //output files open at once, from the descriptor limit unless set
+bool indexOnly = false; //write event indexes instead of converting
+std::map< std::string , std::vector< std::pair<int,int> > > regions; //chrID to sorted, merged 1-based [start,end]
+std::vector< std::vector< std::pair<int,int> > > refRegions; //the same by refID, empty for references outside the regions
+std::string servePath; //unix socket, empty unless serving
+size_t cacheMemory = 256*1024*1024; //bytes of converted events kept by the server
+std::string checkpointFilename; //in the output directory, empty when sorting
+std::map< std::string , std::pair<uint64_t,uint64_t> > checkpointInputs; //Pindel file to bytes converted and its size
+uint64_t checkpointPending = 0; //bytes converted since the checkpoint was written
+bool resuming = false; //outputs were cut back to a checkpoint
+std::string cacheDirectory; //empty unless --cache
+std::string mergedOutput; //--merge name, empty unless every sample goes to one output with read groups
+bool shardOutput = false; //one sorted output per sample and chromosome
+uint32_t cacheSettings = 0; //checksum of the config, fai and options the fragments depend on
+
+int handle_inputs( int , char** , std::vector<std::string>& ); //sets options, returns positional args
 int str2int( const std::string& );
 std::string int2str( const int& );
+void append_decimal( std::string& , int ); //int2str without the stringstream
+int span2int( const struct text_span& ); //atoi on a span
+void span2str( const struct text_span& , std::string& );
+
+bool open_reader( struct pindel_reader& , const std::string& ); //maps the whole file, the descriptor is not kept
+void close_reader( struct pindel_reader& );
+bool next_line( struct pindel_reader& , struct text_span& ); //line without the newline
+bool next_token( struct text_span& , struct text_span& ); //whitespace separated token, advances the line
+int skip_tokens( struct text_span& , int ); //returns number skipped, or for 0 the leading white space skipped
+void skip_to_separation( struct pindel_reader& ); //leaves the reader at the next # line
+const char* find_separation( const char* , const char* , const char* ); //start of the first # line at or after a position
+int line_number( struct pindel_reader& ); //line last read, counted from the start of the file
+
+bool inflate_more( struct pindel_reader& , std::string& ); //appends text from a gzip input, false at its end
+bool next_piece( struct pindel_reader& , std::string& ); //whole events of a gzip input, about CHUNKSIZE bytes
+bool index_bgzf( struct pindel_reader& ); //finds the blocks of a BGZF input, false for other gzip files
+bool inflate_block( z_stream& , const char* , size_t , std::string& ); //appends one BGZF block, false if it is damaged
+void inflate_piece( struct chunk_queue& , unsigned ); //inflates a BGZF piece and cuts it at # lines
+void convert_compressed( struct pindel_reader& , const struct header& , std::map<std::string,std::string>& , std::map<std::string,int>& , std::vector<struct record_batch>& ); //gzip input on the calling thread
+
+bool parse_region( const std::string& , std::string& , int& , int& ); //chr, chr:start-end or chr:start to chrID, 1-based [start,end]
+int add_region( const std::string& ); //returns 0 on success
+int read_bed_file( const std::string& ); //returns 0 on success
+void merge_regions();
+void resolve_regions( const struct header& ); //regions by reference ID, for the test on each event
+bool in_regions( int , int ); //refID, BPLeft_plus_one
+void build_event_index( const struct pindel_reader& , struct event_index& ); //one pass over the # and summary lines
+bool load_event_index( const struct pindel_reader& , struct event_index& ); //false if missing or older than the file
+bool read_event_index( const struct pindel_reader& , const std::string& , struct event_index& ); //from one of the places it is saved
+void save_event_index( const struct pindel_reader& , const struct event_index& ); //next to the Pindel file, else in the output or --cache directory
+std::string event_index_name( const struct pindel_reader& , bool ); //true next to the Pindel file, false where it goes when that cannot be written
+void select_events( struct pindel_reader& , std::vector<struct event_group>& ); //byte ranges holding the regions, the whole file without regions
+
+int serve_regions( const std::vector< std::pair<off_t,std::string> >& , const struct header& , std::map<std::string,std::string>& , std::map<std::string,int>& ); //until quit, returns exit status
+std::vector<struct record_batch>& served_group( struct region_server& , unsigned , unsigned ); //converted events of an index group, from the cache if held
+std::string serve_request( struct region_server& , const std::string& ); //BAM slice, or an error line
+
+int load_checkpoint(); //cuts the outputs back to a checkpoint left by a killed run, returns 0 on success
+std::string checkpoint_options(); //the options that change what goes into the outputs
+void checkpoint_input( const struct pindel_reader& , uint64_t , bool ); //bytes of the file in the outputs, true writes the checkpoint now
+void save_checkpoint(); //writes out every output, then the checkpoint
+void sync_writer( struct sam_writer& ); //every record on disk, without the BGZF EOF block
+
+uint32_t crc_data( uint32_t , const char* , size_t ); //crc32 of any length
+bool crc_file( uint32_t& , const std::string& ); //adds the file's contents, false if it cannot be read
+void set_cache_settings( const std::string& , const std::string& ); //config and fai filenames
+void load_fingerprints();
+void save_fingerprints();
+std::string fragment_name( const struct pindel_reader& ); //from the size, mtime and checksum of the file
+bool check_fragment( const std::string& ); //complete and undamaged
+bool replay_fragment( struct pindel_reader& , std::vector<struct record_batch>& ); //commits a cached fragment, false if there is none
+void begin_fragment( const struct pindel_reader& ); //records what the file adds to the outputs
+void record_fragment( const std::vector<struct record_batch>& ); //called as batches are committed
+void write_fragment_blocks();
+void end_fragment(); //keeps the fragment once its file is converted
+
+void select_scanners(); //picks the widest scanners the CPU supports
+size_t scan_space_scalar( const char* , size_t ); //offset of the first white space, or length
+size_t scan_nonspace_scalar( const char* , size_t ); //offset of the first non white space, or length
+size_t scan_newline_scalar( const char* , size_t ); //offset of the first newline, or length
+#ifdef PINDEL2SAM_SIMD
+size_t scan_space_sse42( const char* , size_t );
+size_t scan_nonspace_sse42( const char* , size_t );
+size_t scan_newline_sse42( const char* , size_t );
+size_t scan_space_avx2( const char* , size_t );
+size_t scan_nonspace_avx2( const char* , size_t );
+size_t scan_newline_avx2( const char* , size_t );
+#endif
+size_t (*scan_space)( const char* , size_t ) = scan_space_scalar;
+size_t (*scan_nonspace)( const char* , size_t ) = scan_nonspace_scalar;
+size_t (*scan_newline)( const char* , size_t ) = scan_newline_scalar;
 
 bool check_ending( const std::string );
-void check_separation( std::ifstream& , const char& );
+int check_separation( struct pindel_reader& , const struct text_span& ); //returns 0 for a good # line
 
 int read_config_file( const std::string& , std::map<std::string,std::string>& , std::map<std::string,int>& );
 int read_fafai_file( const std::string& , struct header& );
+void merge_outputs( struct header& , std::map<std::string,std::string>& , std::map<std::string,int>& ); //every sample to mergedOutput, with an @RG line each
 
 void set_header_custom( struct header& , const std::string& );
+uint32_t reference_hash( const char* , size_t );
+void build_reference_table( struct header& ); //hash table of chrOrder for find_reference
+int find_reference( const struct header& , const char* , size_t ); //refID of a contig name, -1 if not in the reference index
 void set_header_bottom( struct header& );
-int set_reference_detail( std::ifstream& , struct pindel_fields& );
-int set_pindel_fields( std::ifstream& , struct pindel_fields& );
-void set_support( std::ifstream& , int , struct support_data& , std::map<std::string,std::string>& , std::map<std::string,int>& , const int );
-void set_supports( std::ifstream& , struct pindel_fields& , std::map<std::string,std::string>& , std::map<std::string,int>& , const int ); //fills supports field of pindel_field struct
-
-void field_conversion( struct pindel_fields& , int , struct sam_fields& );
-std::string create_CIGAR( std::string , std::string , std::string , int , int , bool& ); //indelType, indelSize, NT_size, readLength, leftIndelPos = BPLeft_plus_one - POS + 1, do true CIGAR
-std::string determine_POS( const std::string , const int ); //leftReadLength, BPLeft_plus_one
-
-void print_update( int& );
+int set_reference_detail( struct pindel_reader& , struct pindel_fields& );
+int set_pindel_fields( struct pindel_reader& , struct text_span , const struct header& , struct pindel_fields& );
+int set_support( struct pindel_reader& , struct text_span , struct pindel_fields& , struct support_data& , std::map<std::string,std::string>& , std::map<std::string,int>& , const int ); //returns 0 for a usable read
+void set_supports( struct pindel_reader& , struct pindel_fields& , std::map<std::string,std::string>& , std::map<std::string,int>& , const int ); //fills supports field of pindel_field struct
+
+void event_conversion( const struct pindel_fields& , const struct header& , struct sam_event& ); //columns shared by the event's reads
+void field_conversion( const struct pindel_fields& , int , const struct sam_event& , struct sam_fields& );
+char* arena_alloc( struct event_arena& , size_t ); //bytes kept until the arena is reset
+void arena_reset( struct event_arena& ); //O(1), the blocks are kept for the next event
+void arena_free( struct event_arena& );
+template <int> int pack_CIGAR( uint32_t* , int , int , int , int ); //BAM ops for readLength, leftIndelPos = BPLeft_plus_one - POS + 1, indelSize, NT_size; returns the op count, 0 for lengths out of range
+void append_CIGAR( std::string& , const uint32_t* , int ); //packed ops as text
+int determine_POS( int , int ); //BPLeft_plus_one, leftReadLength
+
+void print_update( int , int& );
 void print_header( const struct header& );
 void print_pindel_fields( const struct pindel_fields& ); //prints all strings in pindel_fields struct
 void print_support_with_summary( const struct pindel_fields& , int );
 void print_support_data( const struct support_data& );
-void print_supports( const std::vector<struct support_data>& ); //prints int and all strings in support_data struct
-void print_sam( const struct sam_fields& );
+void print_supports( const std::vector<struct support_data>& , unsigned ); //prints int and all strings in support_data struct
+void print_sam( const struct sam_event& , const struct sam_fields& );
 
-void clear_support_data( struct support_data& ); //clears all data in support_data struct
 void clear_supports( std::vector<struct support_data>& );
 
-void save_header( const struct header& , std::map<std::string,std::string>& );
-void save_sam( const struct sam_fields& , const std::string& );
-void write_files( struct pindel_fields& , std::map<std::string,std::string>& , std::map<std::string,int>& ); //writes the Pindel conversion to SAM
-
-struct pindel_fields {
-	std::string indelType;
-	std::string indelSize;
-	std::string NT_size;
-	std::string NT_sequence;
-	std::string chrID;
-	std::string BPLeft_plus_one;
-	std::string NumSupports;
-	std::string NumSupSamples;
-	std::vector<struct support_data> supports;
+void save_header( const struct header& , std::map<std::string,std::string>& , std::map<std::string,int>& );
+void save_sam( const struct sam_event& , const struct sam_fields& , bool , struct record_batch& , std::ostream& ); //formats SAM or encodes BAM straight into the batch
+void commit_batches( std::vector<struct record_batch>& ); //moves converted records to the outputs, empties the batches
+void flush_writer( struct sam_writer& , bool ); //true writes everything, including the BGZF EOF block
+void flush_buffers(); //writes out the largest buffers while all of them hold more than sortMemory
+void flush_tail( struct sam_writer& ); //sends what is left of a BGZF buffer as a block shorter than BGZFBLOCKSIZE
+bool open_writer( struct sam_writer& ); //opens the output's file if it is closed, closing the least recently written beyond maxOpenOutputs
+void release_writer( struct sam_writer& ); //closes the output's file, needs fileLock
+void close_writers( const struct header& ); //finishes every output on finalizeThreads threads
+void* finalize_outputs( void* ); //finalize thread
+void finalize_writer( struct sam_writer& , const struct header& ); //sorts, writes the rest, indexes and closes one output
+size_t finalize_memory( const struct sam_writer& ); //bytes finishing an output needs beyond the records it holds
+bool larger_output( const std::pair<size_t,unsigned>& , const std::pair<size_t,unsigned>& ); //most memory first, then in output order
+uint64_t sort_key( const struct sam_event& , const struct sam_fields& ); //refID then POS, unknown references last
+void spill_run( struct sam_writer& ); //writes the sorted records held in memory to a temporary run
+void release_sort_memory( struct sam_writer& ); //frees the records held for sorting and takes them off sortMemoryUsed
+void merge_runs( struct sam_writer& , const struct header& ); //k-way merges the runs into the output buffer
+void write_sorted( struct sam_writer& , const struct header& , uint64_t , const char* , size_t ); //next record in sorted order, starting a new shard at a new reference
+void next_shard( struct sam_writer& , const struct header& , int ); //closes the shard being written and opens the reference's
+void finish_shard( struct sam_writer& , const struct header& ); //adds it to the output's manifest lines
+bool read_run_record( FILE* , uint64_t& , std::string& );
+void index_record( struct sam_writer& , const char* , size_t ); //queues a record just added to the buffer for indexing
+void index_resolve( struct sam_writer& ); //indexes queued records whose blocks have been written
+void index_add( struct bam_index& , int , int , int , uint64_t , uint64_t );
+uint64_t virtual_offset( const struct sam_writer& , uint64_t ); //uncompressed stream offset to BGZF virtual offset
+void save_index( struct sam_writer& ); //writes .bai, or .csi for long references
+void write_files( struct pindel_fields& , const struct header& , std::vector<struct record_batch>& , std::ostream& ); //converts each support into its output's batch
+void convert_events( struct pindel_reader& , const struct header& , std::map<std::string,std::string>& , std::map<std::string,int>& , std::vector<struct record_batch>& , bool ); //true writes each event as it is converted
+bool larger_file( const std::pair<off_t,std::string>& , const std::pair<off_t,std::string>& ); //largest first, then by name
+void convert_files( std::vector<struct pindel_reader>& , const struct header& , std::map<std::string,std::string>& , std::map<std::string,int>& ); //on parseThreads threads, written in file order
+void* convert_chunks( void* ); //parse thread
+int chunk_line_base( struct chunk_queue& , unsigned ); //lines before a piece, counted when first needed
+void prefetch_chunk( const struct pindel_chunk& ); //starts reading a piece from disk before a parse thread takes it
+
+void put_int32( std::string& , int32_t ); //little-endian
+void put_uint32( std::string& , uint32_t );
+void put_uint16( std::string& , uint16_t );
+int reg2bin( int , int , int , int ); //0-based [beg,end), min_shift, levels to bin
+int index_levels( const struct header& ); //levels needed to bin the longest reference
+int32_t get_int32( const char* ); //little-endian
+void bam_span( const char* , int& , int& , int& ); //refID, 0-based [beg,end) of an encoded record
+void bam_header( const struct header& , std::string& );
+int bam_record( const struct sam_event& , const struct sam_fields& , std::string& ); //appends encoded record, returns 0 on success
+int bgzf_block( const char* , size_t , std::string& , int ); //compresses one block at a level, returns 0 on success
+
+void start_compressors();
+void stop_compressors();
+void* compress_blocks( void* ); //compression thread
+void bgzf_submit( struct sam_writer& , const char* , size_t ); //queues a block, written in order once compressed
+void complete_job( struct bgzf_job* ); //needs poolLock
+void drain_writer( struct sam_writer& ); //writes compressed blocks in order, needs poolLock
+void bgzf_wait( struct sam_writer& ); //until every queued block of the output is written
+
+struct text_span {
+	const char* ptr; //into the mapped file
+	size_t len;
+};
+
+struct event_arena {
+	std::vector< std::pair<char*,size_t> > blocks; //never moved, so handed out bytes stay put
+	unsigned block; //in use
+	size_t used; //bytes of the block in use
+};
+
+struct pindel_reader {
+	std::string filename;
+	const char* data; //whole file, read only
+	size_t size;
+	const char* cur; //start of the next line
+	const char* end;
+	int linenum; //lines read
+	int linebase; //lines before data, -1 until a piece needs it
+	int nextprint; //line of the next progress message
+	std::ostream* log; //messages, std::cout or a piece's buffer
+	struct chunk_queue* chunks; //when converting a piece of a file
+	unsigned chunk;
+	struct gzip_input* gz; //NULL unless data is gzip compressed
+	std::string fragment; //cached conversion, empty without --cache
+};
+
+struct input_fingerprint {
+	uint64_t size;
+	int64_t mtime;
+	uint32_t crc; //of the contents
+};
+
+struct fragment_writer {
+	FILE* file; //NULL unless a conversion is being recorded
+	std::string filename; //written as filename.tmp until complete
+	std::vector<struct record_batch> batches; //one per output, waiting to be written
+	size_t bytes;
+	bool failed;
+};
+
+struct event_group { //events of one chromosome next to each other in a Pindel file
+	int chr; //into event_index.chrs
+	int minBP, maxBP; //BPLeft_plus_one
+	uint64_t begin, end; //byte offsets, begin is at a # line
+	int lines; //lines before begin
+};
+
+struct event_index {
+	uint64_t size; //of the indexed file
+	int64_t mtime;
+	std::vector<std::string> chrs;
+	std::vector<struct event_group> groups; //in file order, each ends where the next begins
+};
+
+struct served_file {
+	struct pindel_reader reader;
+	struct event_index index;
+};
+
+struct served_entry { //converted events of one index group
+	std::pair<unsigned,unsigned> key; //file, group
+	std::vector<struct record_batch> batches; //one per output, BAM with sort entries
+	size_t bytes;
+};
+
+struct region_server {
+	const struct header* h;
+	std::map<std::string,std::string>* sm;
+	std::map<std::string,int>* om;
+	std::vector<struct served_file> files;
+	std::list<struct served_entry> cache; //most recently used first
+	std::map< std::pair<unsigned,unsigned> , std::list<struct served_entry>::iterator > cached;
+	size_t cacheUsed;
+};
+
+struct gzip_input {
+	z_stream stream; //read from start to end when not split into BGZF pieces
+	bool started;
+	bool finished;
+	size_t consumed; //compressed bytes given to the stream
+	std::string carry; //text after the last whole event of the previous piece
+	std::vector<size_t> blocks; //offsets of the BGZF blocks and the end of the last one
+};
+
+struct pindel_fields { //numbers parsed once from the summary line
+	char indelType; //D or I
+	int indelSize;
+	int NT_size;
+	struct text_span NT_sequence; //valid until the next event
+	struct text_span chrID; //valid until the next event
+	int refID; //chrID in the reference index
+	int BPLeft_plus_one;
+	int NumSupports;
+	int NumSupSamples;
+	std::vector<struct support_data> supports; //kept between events so their strings are reused
+	unsigned supportsRead; //supports of this event, at the front of supports
+	struct event_arena arena; //joined halves of gapped reads, reset for each event
+	std::string sample; //readBAMsource being looked up, reused
 };
 
 struct support_data {
 	int leftOfIndel;
-	std::string readSequence;
-	std::string readBAMsource;
-	std::string readBarcode;
+	int output; //outputMap value of readBAMsource, found once in set_support
+	struct text_span readSequence; //into the event text, or the event arena when the read has a gap
+	struct text_span readBAMsource;
+	struct text_span readBarcode;
+};
+
+struct sam_event { //what the reads of one Pindel event share
+	int refID;
+	std::string flagColumns; //SAM text between QNAME and POS: FLAG and RNAME
+	int (*pack)( uint32_t* , int , int , int , int ); //the event's pack_CIGAR, NULL if it has none
+	bool complex; //CIGAR repeated in a CI:Z tag
+	bool longReference; //too long for BAI bins, so the reads get LONGREFERENCEBIN
+};
+
+struct sam_fields { //what differs between the reads of an event
+	struct text_span QNAME;
+	int POS;
+	uint32_t CIGAR[MAXCIGAROPS]; //packed BAM ops, length<<4|op
+	int CIGARops; //0 when the read's lengths do not make a CIGAR
+	struct text_span SEQ;
+	struct text_span RG; //the sample, empty unless merging
+};
+
+struct sort_entry {
+	uint64_t key;
+	size_t offset; //into sam_writer.records
+	size_t length;
+};
+
+bool operator<( const struct sort_entry& a , const struct sort_entry& b ) { return a.key < b.key; }
+
+struct record_batch {
+	std::string data; //encoded records for one output
+	std::vector<struct sort_entry> entries; //offsets into data, when sorting
+};
+
+struct pindel_chunk {
+	struct pindel_reader* file;
+	const char* begin; //at a # line
+	const char* end;
+	int lines; //lines before begin, -1 until needed
+	int linesRead;
+	bool done;
+	unsigned block, blockEnd; //BGZF blocks inflated into text by the parse thread
+	std::string text;
+	bool counted; //blockLines and headLines are set
+	int blockLines; //lines in the blocks
+	int headLines; //lines from the first block to begin, which belong to the previous piece
+	std::string log; //messages, printed when written
+	std::vector<struct record_batch> batches; //one per output
+};
+
+struct chunk_queue {
+	const struct header* h;
+	std::map<std::string,std::string>* sm;
+	std::map<std::string,int>* om;
+	std::vector<struct pindel_chunk> chunks; //pieces of every file, largest file first
+	unsigned next; //first piece not yet taken by a parse thread
+	unsigned written; //first piece not yet written
+};
+
+struct finalize_queue {
+	const struct header* h;
+	std::vector< std::pair<size_t,unsigned> > outputs; //finalize_memory and outputWriters index, largest first
+	unsigned next; //first output not yet taken by a finalize thread
+	size_t memoryUsed; //finalize_memory of the outputs being finished
+	int running;
+};
+
+struct index_ref {
+	std::map< uint32_t , std::vector< std::pair<uint64_t,uint64_t> > > bins; //bin to chunks of virtual offsets
+	std::vector<uint64_t> linear; //smallest virtual offset per 16 kbp window, 0 if none
+	uint64_t first, last; //virtual offsets spanning the reference
+	uint64_t mapped;
+};
+
+struct bam_index {
+	int levels; //5 for BAI
+	std::vector<struct index_ref> refs;
+	uint64_t unplaced; //records without a reference
+};
+
+struct index_pending {
+	int refID, beg, end;
+	uint64_t ubeg, uend; //offsets in the uncompressed stream
 };
 
-struct sam_fields {
-	std::string QNAME;
-	std::string FLAG;
-	std::string MAPQ;
-	std::string RNAME;
-	std::string POS;
-	std::string CIGAR;
-	std::string RNEXT;
-	std::string PNEXT;
-	std::string TLEN;
-	std::string SEQ;
-	std::string QUAL;
-	std::string optional;
+struct bgzf_job {
+	struct sam_writer* writer;
+	std::string data; //uncompressed
+	std::string block; //compressed
+	bool done;
 };
 
+struct sam_writer {
+	std::string filename; //full output path
+	FILE* file; //NULL while closed to make room for other outputs, records wait in buffer
+	bool created; //the file was started this run or is appended to, so it is reopened with "a"
+	bool busy; //being finished, its file is not closed for another output
+	bool synced; //nothing written or buffered since checkpointSize was taken
+	uint64_t checkpointSize; //file size in the last checkpoint
+	std::list<struct sam_writer*>::iterator recent; //in openWriters while file is open
+	std::string shardBase; //output path without the chromosome and extension when sharding
+	std::string header; //written at the start of each shard
+	int shardRef; //reference of the shard being written
+	uint64_t shardReads; //in the shard being written
+	std::string shardLines; //manifest lines of the shards written
+	bool bgzf; //buffer holds uncompressed BAM data
+	std::string buffer; //records waiting to be written
+	std::string records; //encoded records waiting to be sorted
+	std::vector<struct sort_entry> entries;
+	std::vector<std::string> runs; //sorted runs spilled to disk
+	bool indexed; //build an index while writing
+	uint64_t ubase; //uncompressed bytes already taken out of buffer
+	uint64_t coffset; //compressed bytes written
+	std::vector<uint64_t> blockAddress; //file offset of each BGZF block of records written
+	std::vector<uint64_t> blockStart; //uncompressed stream offset of the same blocks, which need not be full
+	std::vector<struct index_pending> pending;
+	struct bam_index index;
+	std::deque<struct bgzf_job*> inflight; //blocks submitted, in file order
+	bool draining; //a thread is writing finished blocks
+	uint64_t uwritten; //uncompressed bytes in written blocks
+};
+
+pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER; //guards jobs, inflight blocks and block addresses
+pthread_cond_t jobReady = PTHREAD_COND_INITIALIZER;
+pthread_cond_t jobDone = PTHREAD_COND_INITIALIZER;
+std::deque<struct bgzf_job*> jobQueue;
+std::vector<pthread_t> compressors;
+int jobsOutstanding = 0;
+bool poolStopping = false;
+
+std::vector<struct sam_writer> outputWriters; //indexed by outputMap value
+std::list<struct sam_writer*> openWriters; //outputs with an open file, most recently written first
+pthread_mutex_t fileLock = PTHREAD_MUTEX_INITIALIZER; //guards openWriters and opening or closing output files
+std::map<std::string,struct input_fingerprint> fingerprints; //Pindel file path to its last checksum
+struct fragment_writer fragmentOut = { NULL , "" , std::vector<struct record_batch>() , 0 , false };
+
+pthread_mutex_t chunkLock = PTHREAD_MUTEX_INITIALIZER; //guards the pieces of the files being converted
+pthread_cond_t chunkDone = PTHREAD_COND_INITIALIZER;
+pthread_cond_t chunkRoom = PTHREAD_COND_INITIALIZER;
+
+pthread_mutex_t finalizeLock = PTHREAD_MUTEX_INITIALIZER; //guards the finalize queue and sortMemoryUsed once conversion is done
+pthread_cond_t finalizeRoom = PTHREAD_COND_INITIALIZER;
+
 struct header {
 	std::string top; //@HD\tVN:SAMVERSION
 	std::string custom; //reference sequence info
 	std::string bottom; //@PG\tID:Pindel\tVN:PINDELVERSION
-	std::map<std::string,int> chrLen; //if need to track references within file
+	std::vector<std::string> chrOrder; //references in .fai order, the position is the BAM refID
+	std::vector<int> refLen; //by refID
+	std::vector<int> refTable; //open addressing hash of chrOrder to refID, -1 for empty slots
 };
 
 int main( int argc, char* argv[] )
 {
 /* TAKE INPUTS FROM COMMAND LINE: PINDEL DATA FILE, PINDEL CONFIG FILE */
-//	handleInputs(argc,argv,first_line,last_line);
+	std::vector<std::string> args;
+	if ( handle_inputs( argc , argv , args ) != 0 )
+		return 1;
+	select_scanners();
 
-	std::string inputDirectoryName = argv[1];
+	std::string inputDirectoryName = args[0];
 	if ( inputDirectoryName[inputDirectoryName.length()] != '/' )
 		inputDirectoryName += "/";
-	outputDirectoryName = argv[2];
+	outputDirectoryName = args[1];
 	if ( outputDirectoryName[outputDirectoryName.length()] != '/' )
 		outputDirectoryName += "/";
 	DIR *dirp = opendir( inputDirectoryName.c_str() );
 	struct dirent *indir;
 
 	std::string pindelFilename;
-	std::ifstream fromPindel;
+	std::vector< std::pair<off_t,std::string> > pindelFiles; //size and path
+	std::vector<struct pindel_reader> readers; //opened for the parse threads
+	struct pindel_reader fromPindel;
+	struct stat st;
 
-	struct pindel_fields PIN;
 	struct header head;
-
-	int nextprint;
-
-	char dummy;
-	std::string line, temp;
-	int leftRefLength;
+	std::vector<struct record_batch> batches;
 
 //	std::iostream error_value;
 //	std::iostream error_log;
 
 /* GET INFO FROM CONFIG FILE - file with primary output filename piece */
-	std::string configFilename = argv[3];
+	std::string configFilename = args[2];
 	std::map<std::string,std::string> sampleMap;
 	std::map<std::string,int> outputMap;
 	int configIn = read_config_file( configFilename , sampleMap , outputMap );
 	NUMBEROFSAMPLES = configIn;
 
 /* GET HEADER INFO FROM REFERENCE INDEX FILE - file with SAM header sequence info */
-	std::string referenceIndexFilename = argv[4];
+	std::string referenceIndexFilename = args[3];
 	int referenceIn = read_fafai_file( referenceIndexFilename , head );
-	save_header( head , sampleMap );
+	resolve_regions( head );
+	if ( !mergedOutput.empty() )
+		merge_outputs( head , sampleMap , outputMap );
 
 /* GET INFO FROM PINDEL DATA FILE */
-	int pFnlen;
 	while ( indir = readdir( dirp ) ) //directory position returns 0 when done
 	{
 		pindelFilename = (std::string)indir->d_name;
-		pFnlen = pindelFilename.length()-1;
 		if ( check_ending( pindelFilename ) ) //checks for _D & _SI
 		{
-			fromPindel.open( ( inputDirectoryName+pindelFilename ).c_str() );
-			if ( fromPindel.good() && configIn && referenceIn ) //have a file to check
-			{
-				std::cout << "\t\tOpened: " << inputDirectoryName+pindelFilename << std::endl;
+			if ( stat( ( inputDirectoryName+pindelFilename ).c_str() , &st ) != 0 )
+				st.st_size = 0; //reported when it fails to open
+			pindelFiles.push_back( std::make_pair( st.st_size , inputDirectoryName+pindelFilename ) );
+		}//if _D or _SI
+	}//while files available to read in
+	int tempint = closedir( dirp );
+	std::sort( pindelFiles.begin() , pindelFiles.end() , larger_file ); //so the longest files do not start last
 
-				linenum = 0;
-				nextprint = UPDATEFREQUENCY;
+	if ( indexOnly ) //event indexes only, no outputs
+	{
+		struct event_index index;
+		for ( unsigned f = 0; f < pindelFiles.size(); f++ )
+		{
+			if ( !open_reader( fromPindel , pindelFiles[f].second ) )
+				std::cout << "PINDEL2SAM_ERROR: could not open " << pindelFiles[f].second << std::endl;
+			else if ( fromPindel.gz )
+				std::cout << "PINDEL2SAM_WARNING: cannot index compressed " << fromPindel.filename << ", regions are found by reading all of it" << std::endl;
+			else
+			{
+				build_event_index( fromPindel , index );
+				save_event_index( fromPindel , index );
+				std::cout << "\t\tIndexed: " << fromPindel.filename << " (" << index.groups.size() << " groups)" << std::endl;
+			}
+			close_reader( fromPindel );
+		}
+		return 0;
+	}
+	if ( !servePath.empty() ) //answer region requests instead of converting
+		return serve_regions( pindelFiles , head , sampleMap , outputMap );
+	if ( !sortOutput ) //sorted outputs are replaced by every run
+	{
+		checkpointFilename = outputDirectoryName+CHECKPOINTFILENAME;
+		if ( load_checkpoint() != 0 )
+			return 1;
+	}
+	else //outputs start over, so a checkpoint left by a killed unsorted run no longer fits them
+		remove( ( outputDirectoryName+CHECKPOINTFILENAME ).c_str() );
+	if ( !cacheDirectory.empty() )
+	{
+		if ( cacheDirectory[cacheDirectory.length()-1] != '/' )
+			cacheDirectory += "/";
+		set_cache_settings( configFilename , referenceIndexFilename );
+		load_fingerprints();
+	}
+	start_compressors();
+	save_header( head , sampleMap , outputMap );
+	if ( !checkpointFilename.empty() ) //a run killed before its first checkpoint resumes from the headers
+		save_checkpoint();
 
-				while ( fromPindel >> dummy )
+	for ( unsigned f = 0; f < pindelFiles.size(); f++ )
+	{
+		std::map< std::string , std::pair<uint64_t,uint64_t> >::iterator cit = checkpointInputs.find( pindelFiles[f].second );
+		if ( cit != checkpointInputs.end() && cit->second.first >= cit->second.second ) //finished before the restart
+		{
+			std::cout << "\t\tAlready converted: " << pindelFiles[f].second << std::endl;
+			continue;
+		}
+		if ( open_reader( fromPindel , pindelFiles[f].second ) && configIn && referenceIn ) //have a file to check
+		{
+			if ( !cacheDirectory.empty() )
+				fromPindel.fragment = fragment_name( fromPindel );
+			if ( parseThreads > 0 ) //converted together below
+			{
+				readers.push_back( fromPindel );
+				continue;
+			}
+			std::cout << "\t\tOpened: " << fromPindel.filename << std::endl;
+			batches.resize( outputWriters.size() );
+			if ( replay_fragment( fromPindel , batches ) ) //unchanged since it was cached
+				;
+			else if ( fromPindel.gz )
+			{
+				begin_fragment( fromPindel );
+				convert_compressed( fromPindel , head , sampleMap , outputMap , batches );
+				end_fragment();
+			}
+			else //the parts of the file holding the regions and not yet converted
+			{
+				std::vector<struct event_group> ranges;
+				struct pindel_reader piece = fromPindel;
+				begin_fragment( fromPindel );
+				select_events( fromPindel , ranges );
+				for ( unsigned r = 0; r < ranges.size(); r++ )
 				{
-					temp = "";
-					leftRefLength = 0;
-
-					print_update( nextprint );
-
-					// SUMMARY SEPARATION LINE
-					check_separation( fromPindel , dummy ); //check # count
-
-					// SUMMARY DATA LINE
-					value = set_pindel_fields( fromPindel , PIN ); //set summary data
-
-					if ( value == 0 ) //no errors from summary section
-					{
-						// REFERENCE LINE
-						leftRefLength = set_reference_detail( fromPindel , PIN );
-
-						// READ SUPPORTS
-						set_supports( fromPindel , PIN , sampleMap , outputMap , leftRefLength );
-
-						// WRITE TO FILE
-						write_files( PIN , sampleMap , outputMap );
-					}
-					else
-					{//Error in summary	
-						std::cout << "PINDEL2SAM_ERROR: bad summary on line = " << linenum << std::endl;
-						std::getline( fromPindel , line );
-						linenum++;
-					}//if reading supports
-				}//while reading file
-				fromPindel.close();
-				std::cout << "\t\t\t\tClosed: " << inputDirectoryName+pindelFilename << std::endl;
-			}//if file opened
-			else
-			{//Error opening file
-				std::cout << "PINDEL2SAM_ERROR: could not open " << inputDirectoryName+pindelFilename << std::endl;
+					piece.cur = fromPindel.data+ranges[r].begin;
+					piece.end = fromPindel.data+ranges[r].end;
+					piece.linebase = ranges[r].lines;
+					piece.linenum = 0;
+					convert_events( piece , head , sampleMap , outputMap , batches , true );
+				}
+				end_fragment();
 			}
-		}//if _D or _SI
-	}//while files available to read in
-	int tempint = closedir( dirp );
+			if ( !checkpointFilename.empty() )
+				checkpoint_input( fromPindel , fromPindel.size , true );
+			close_reader( fromPindel );
+			std::cout << "\t\t\t\tClosed: " << fromPindel.filename << std::endl;
+		}//if file opened
+		else
+		{//Error opening file
+			std::cout << "PINDEL2SAM_ERROR: could not open " << pindelFiles[f].second << std::endl;
+		}
+	}//for each file
+	if ( !readers.empty() )
+		convert_files( readers , head , sampleMap , outputMap );
+	if ( !cacheDirectory.empty() )
+		save_fingerprints();
+	close_writers( head );
+	stop_compressors();
+	if ( !checkpointFilename.empty() ) //finished, a later run starts afresh
+		remove( checkpointFilename.c_str() );
 
 	return 0;
 }//main
 
 /* FUNCTIONS */
+int handle_inputs( int argc , char* argv[] , std::vector<std::string>& args )
+{
+	std::string arg;
+	for ( int a = 1; a < argc; a++ )
+	{
+		arg = argv[a];
+		if ( arg == "--format" && a+1 < argc )
+		{
+			outputFormat = argv[++a];
+			if ( outputFormat != "sam" && outputFormat != "bam" )
+			{
+				std::cout << "PINDEL2SAM_ERROR: unknown output format " << outputFormat << " (use sam or bam)" << std::endl;
+				return 1;
+			}
+		}
+		else if ( arg == "--sort" )
+			sortOutput = true;
+		else if ( arg == "--shard" )
+			shardOutput = sortOutput = true;
+		else if ( arg == "--sort-memory" && a+1 < argc )
+		{
+			int mib = str2int( argv[++a] );
+			if ( mib <= 0 )
+			{
+				std::cout << "PINDEL2SAM_ERROR: sort memory must be at least 1 MiB" << std::endl;
+				return 1;
+			}
+			sortMemory = (size_t)mib*1024*1024;
+		}
+		else if ( arg == "--threads" && a+1 < argc )
+			numberOfThreads = std::max( 0 , str2int( argv[++a] ) );
+		else if ( arg == "--index" )
+			indexOnly = true;
+		else if ( arg == "--region" && a+1 < argc )
+		{
+			if ( add_region( argv[++a] ) != 0 )
+				return 1;
+		}
+		else if ( arg == "--regions" && a+1 < argc )
+		{
+			if ( read_bed_file( argv[++a] ) != 0 )
+				return 1;
+		}
+		else if ( arg == "--serve" && a+1 < argc )
+			servePath = argv[++a];
+		else if ( arg == "--cache-memory" && a+1 < argc )
+			cacheMemory = (size_t)std::max( 1 , str2int( argv[++a] ) )*1024*1024;
+		else if ( arg == "--cache" && a+1 < argc )
+			cacheDirectory = argv[++a];
+		else if ( arg == "--merge" && a+1 < argc )
+		{
+			mergedOutput = argv[++a];
+			if ( mergedOutput.empty() || mergedOutput.find( '/' ) != std::string::npos )
+			{
+				std::cout << "PINDEL2SAM_ERROR: --merge takes an output name without a directory" << std::endl;
+				return 1;
+			}
+		}
+		else if ( arg == "--parse-threads" && a+1 < argc )
+			parseThreads = std::max( 0 , str2int( argv[++a] ) );
+		else if ( arg == "--finalize-threads" && a+1 < argc )
+			finalizeThreads = std::max( 1 , str2int( argv[++a] ) );
+		else if ( arg == "--open-outputs" && a+1 < argc )
+			maxOpenOutputs = std::max( 1 , str2int( argv[++a] ) );
+		else if ( arg == "--level" && a+1 < argc )
+		{
+			compressionLevel = str2int( argv[++a] );
+			if ( compressionLevel < 0 || compressionLevel > 9 )
+			{
+				std::cout << "PINDEL2SAM_ERROR: compression level must be 0-9" << std::endl;
+				return 1;
+			}
+		}
+		else if ( arg.compare( 0 , 2 , "--" ) == 0 )
+		{
+			std::cout << "PINDEL2SAM_ERROR: unknown or incomplete option " << arg << std::endl;
+			return 1;
+		}
+		else
+			args.push_back( arg );
+	}
+	if ( args.size() != 4 )
+	{
+		std::cout << "PINDEL2SAM_ERROR: need four inputs\n";
+		std::cout << "pin2sam <pindel_data_directory> <output_directory> pindel_config_file pindel_reference_index_file [--format sam|bam] [--sort] [--sort-memory MiB] [--threads N] [--level 0-9] [--parse-threads N] [--finalize-threads N] [--open-outputs N] [--index] [--region chr:start-end] [--regions file.bed] [--serve socket] [--cache-memory MiB] [--cache dir] [--merge name] [--shard]" << std::endl;
+		return 1;
+	}
+	if ( parseThreads < 0 ) //--threads sizes every pool
+		parseThreads = numberOfThreads;
+	if ( finalizeThreads < 0 )
+		finalizeThreads = std::max( 1 , numberOfThreads );
+	if ( maxOpenOutputs == 0 ) //leave half the descriptors for inputs, runs and indexes
+	{
+		struct rlimit limit;
+		if ( getrlimit( RLIMIT_NOFILE , &limit ) == 0 && limit.rlim_cur != RLIM_INFINITY )
+			maxOpenOutputs = (int)std::max( (rlim_t)1 , std::min( limit.rlim_cur/2 , (rlim_t)MAXOPENOUTPUTS ) );
+		else
+			maxOpenOutputs = MAXOPENOUTPUTS;
+	}
+	merge_regions();
+	return 0;
+}
+
 int str2int( const std::string& str )
 {
 	return atoi( str.c_str() );
 }
 
+void append_decimal( std::string& out , int value )
+{
+	char digits[12], *d = digits+sizeof( digits );
+	unsigned u = value < 0 ? 0u-(unsigned)value : (unsigned)value;
+
+	do
+	{
+		*--d = '0'+u%10;
+		u /= 10;
+	} while ( u > 0 );
+	if ( value < 0 )
+		*--d = '-';
+	out.append( d , digits+sizeof( digits )-d );
+}
+
 std::string int2str( const int& ent )
 {
 	std::stringstream ss;
@@ -931,434 +1549,3101 @@ std::string int2str( const int& ent )
 	return str;
 }
 
-bool check_ending( const std::string filename )
+int span2int( const struct text_span& span )
 {
-	int fnlen = filename.length()-1;
-	if ( ( filename[fnlen] == 'D' && filename[fnlen-1] == '_' ) || 
-	     ( filename[fnlen] == 'I' && filename[fnlen-1] == 'S' && filename[fnlen-2] == '_' ) )
-		return true;
-	else
-		return false;
+	const char* c = span.ptr;
+	const char* end = span.ptr+span.len;
+	int sign = 1, num = 0;
+
+	while ( c < end && isspace( *c ) )
+		c++;
+	if ( c < end && ( *c == '-' || *c == '+' ) )
+		sign = ( *c++ == '-' ) ? -1 : 1;
+	while ( c < end && isdigit( *c ) )
+		num = num*10 + ( *c++ - '0' );
+
+	return sign*num;
+}
+
+void span2str( const struct text_span& span , std::string& str )
+{
+	str.assign( span.ptr , span.len );
 }
 
-void check_separation( std::ifstream& file , const char& dummy )
+/* INPUT */
+static inline bool is_white( char c ) //' ' and '\t' through '\r', the same set as isspace() in the C locale
 {
-	std::string line;
+	return c == ' ' || (unsigned char)( c-'\t' ) <= '\r'-'\t';
+}
 
-	if ( dummy == '#' )	file >> line;
-	if ( line.length() != NUMBEROFPOUNDS-1 )
+static inline size_t find_space( const char* p , size_t len ) //most columns are short, check them before scanning
+{
+	for ( size_t i = 0; i < 8; i++ )
 	{
-		std::cout << "PINDEL2SAM_ERROR: bad number of #'s = " << line.length() << std::endl;
-		value = 1;
+		if ( i == len || is_white( p[i] ) )
+			return i;
 	}
-	linenum++;
+	return 8+scan_space( p+8 , len-8 );
 }
 
-int read_config_file( const std::string& filename , std::map<std::string,std::string>& sampleMap , std::map<std::string,int>& outputMap )
+static inline size_t find_nonspace( const char* p , size_t len ) //columns are usually split by one tab or space
 {
-	std::ifstream file( filename.c_str() );
-	int numsamples = 0;
+	if ( len == 0 || !is_white( p[0] ) )
+		return 0;
+	if ( len == 1 || !is_white( p[1] ) )
+		return 1;
+	return scan_nonspace( p , len );
+}
 
-	if ( file.good() )//successfully opened config file
+bool open_reader( struct pindel_reader& file , const std::string& filename )
+{
+	struct stat st;
+	int fd;
+
+	file.filename = filename;
+	file.data = file.cur = file.end = NULL;
+	file.size = 0;
+	file.linenum = file.linebase = 0;
+	file.nextprint = UPDATEFREQUENCY;
+	file.log = &std::cout;
+	file.chunks = NULL;
+	file.chunk = 0;
+	file.gz = NULL;
+	file.fragment.clear();
+	fd = open( filename.c_str() , O_RDONLY );
+	if ( fd < 0 )
+		return false;
+	if ( fstat( fd , &st ) != 0 )
 	{
-		std::cout << "\t\tOpened: " << filename << std::endl;
-
-		std::string name, sample, temp;
-		while ( file >> name >> temp >> sample )
+		close( fd );
+		return false;
+	}
+	file.size = st.st_size;
+	if ( file.size > 0 )
+	{
+		void* map = mmap( NULL , file.size , PROT_READ , MAP_PRIVATE , fd , 0 );
+		if ( map == MAP_FAILED )
 		{
-			for ( int c = 0; c < name.length(); c++ )
-			{
-				if ( (char)name[c] == '/' )
-					name[c] = '_';
-			}
-			sampleMap[sample] = name;
-			outputMap[name] = numsamples++;
+			close( fd );
+			return false;
 		}
-
-		file.close();
-		std::cout << "\t\t\t\tClosed: " << filename << std::endl;
-
-		return numsamples;
+		madvise( map , file.size , MADV_SEQUENTIAL );
+		file.data = (const char*)map;
 	}
-	else
-	{//Error opening config file
-		std::cout << "PINDEL2SAM_ERROR: could not open " << filename << std::endl;
-
-		return numsamples;
+	close( fd ); //the mapping stays, so many files can be open for the parse threads
+	file.cur = file.data;
+	file.end = file.data+file.size;
+	if ( file.size >= 2 && (unsigned char)file.data[0] == 31 && (unsigned char)file.data[1] == 139 ) //gzip magic, text comes from next_piece
+	{
+		file.gz = new struct gzip_input;
+		file.gz->started = file.gz->finished = false;
+		file.gz->consumed = 0;
+		file.cur = file.end;
 	}
+
+	return true;
 }
 
-int read_fafai_file( const std::string& filename , struct header& h )
+void close_reader( struct pindel_reader& file )
 {
-	std::ifstream file( filename.c_str() );
-	std::string chr, chrlen, temp;
-	int numrefs = 0;
-
-	if ( file.good() )
+	if ( file.data )
+		munmap( (void*)file.data , file.size );
+	if ( file.gz )
 	{
-		std::cout << "\t\tOpened: " << filename << std::endl;
-
-		h.top = "@HD\tVN:"+SAMVERSION+"\n";
-		while ( file >> chr >> chrlen >> temp >> temp >> temp )
-		{
-				h.chrLen[chr] = str2int( chrlen );
-				set_header_custom( h , chr );
-			numrefs++;
-		}
-		set_header_bottom( h );
-
-		file.close();
-		std::cout << "\t\t\t\tClose: " << filename << std::endl;
-
-		return numrefs;
-	}
-	else
-	{//Error opening reference index file
-		std::cout << "PINDEL2SAM_ERROR: could not open " << filename << std::endl;
-
-		return numrefs;
+		if ( file.gz->started )
+			inflateEnd( &file.gz->stream );
+		delete file.gz;
+		file.gz = NULL;
 	}
+	file.data = file.cur = file.end = NULL;
 }
 
-void set_header_custom( struct header& h , const std::string& chr )
+bool next_line( struct pindel_reader& file , struct text_span& line )
 {
-	h.custom += "@SQ\tSN:"+chr+"\tLN:"+int2str( h.chrLen[chr] )+"\n";
+	if ( file.cur >= file.end )
+		return false;
+	line.ptr = file.cur;
+	line.len = scan_newline( file.cur , file.end-file.cur );
+	file.cur += line.len;
+	if ( file.cur < file.end ) //step over the newline
+		file.cur++;
+
+	return true;
 }
 
-void set_header_bottom( struct header& h )
+bool next_token( struct text_span& line , struct text_span& token )
 {
-	h.bottom = "@PG\tPN:Pindel\tVN:"+PINDELVERSION+"\n";
+	size_t white = find_nonspace( line.ptr , line.len );
+	line.ptr += white;
+	line.len -= white;
+	token.ptr = line.ptr;
+	token.len = find_space( line.ptr , line.len );
+	line.ptr += token.len;
+	line.len -= token.len;
+
+	return token.len > 0;
 }
 
-int set_pindel_fields( std::ifstream& file , struct pindel_fields& pid )
+int skip_tokens( struct text_span& line , int n )
 {
-	std::string temp;
-
-	pid.supports.clear();
-
-	file >> temp; //SVIndex
-	file >> pid.indelType >> pid.indelSize;
-	file >> temp; //NT
-	file >> pid.NT_size >> pid.NT_sequence;
-	if ( pid.NT_sequence.length()-2 != str2int( pid.NT_size ) )
-	{//Error NT sequence/size mismatch
-		std::cout << "PINDEL2SAM_ERROR: NT sequence/size mismatch ( " << pid.NT_sequence.length() << " ";
-		std::cout << pid.NT_size << " )\nSkipping support from line = " << linenum << std::endl;
-		std::getline( file , temp );
-
-		return 1;
-	}
-	file >> temp; //Chr
-	file >> pid.chrID;
-	file >> temp; //BP
-	file >> pid.BPLeft_plus_one;
-	file >> temp >> temp >> temp >> temp >> temp; //BPright BP_range left right NumSupports
-	file >> pid.NumSupports;
-	file >> temp >> temp >> temp >> temp >> temp >> temp >> temp >> temp >> temp >> temp >> temp >> temp >> temp;
-	file >> pid.NumSupSamples;
-	if ( str2int( pid.NumSupSamples ) > NUMBEROFSAMPLES )
-	{//Error number of samples mismatch
-		std::cout << "PINDEL2SAM_ERROR: Number of samples mismatch\nSkipping supports from line = " << linenum << std::endl;
-		std::getline( file , temp );
-
-		return 2;
+	int skipped = 0;
+	size_t white = scan_nonspace( line.ptr , line.len ), word;
+
+	line.ptr += white;
+	line.len -= white;
+	if ( n == 0 ) //only leading white space, count it
+		return white;
+	while ( skipped < n && line.len > 0 )
+	{
+		word = find_space( line.ptr , line.len );
+		word += find_nonspace( line.ptr+word , line.len-word );
+		line.ptr += word;
+		line.len -= word;
+		skipped++;
 	}
 
-	std::getline( file , temp ); //read rest of line
-	linenum++;
-
-	return 0;
-	//check specific header sequences
+	return skipped;
 }
 
-int set_reference_detail( std::ifstream& file , struct pindel_fields& pid )
+/* SCANNERS */
+void select_scanners()
 {
-	std::string tempL, tempR;
-
-	linenum++;
-	if ( str2int( pid.NT_size ) > 0 ) //gap in reference
+#ifdef PINDEL2SAM_SIMD
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports( "avx2" ) )
 	{
-		file >> tempL; //reads in left half
-		std::getline( file , tempR ); //reads in right half
-
-		return tempL.length();
+		scan_space = scan_space_avx2;
+		scan_nonspace = scan_nonspace_avx2;
+		scan_newline = scan_newline_avx2;
 	}
-	else //no gap in reference
+	else if ( __builtin_cpu_supports( "sse4.2" ) )
 	{
-		std::getline( file , tempL ); //no info to get, eat whole line
-
-		return tempL.length();
+		scan_space = scan_space_sse42;
+		scan_nonspace = scan_nonspace_sse42;
+		scan_newline = scan_newline_sse42;
 	}
+#endif
 }
 
-void field_conversion( struct pindel_fields& pid , int isup , struct sam_fields& sam )
+size_t scan_space_scalar( const char* p , size_t len )
 {
-	bool iscomplex = false;
-	sam.QNAME = pid.supports[isup].readBarcode;
-	sam.FLAG = "2";
-	sam.RNAME = pid.chrID;
-	sam.POS = determine_POS( pid.BPLeft_plus_one , pid.supports[isup].leftOfIndel );
-	sam.MAPQ = "60"; //filler value
-	sam.CIGAR = create_CIGAR( pid.indelType , pid.indelSize , pid.NT_size , pid.supports[isup].readSequence.length() , pid.supports[isup].leftOfIndel , iscomplex );
-	sam.RNEXT = "*"; //"*" or "=" ("set as '=' if RNEXT is identical RNAME"...should be = for set between summary lines, right?)
-	sam.PNEXT = "0"; //"0" or "This field equals POS at the primary line of the next read. If PNEXT is 0, no assumptions can be made on RNEXT and bit 0x20")
-	sam.TLEN = "0"; //"0" for "single-segment template or when the information is unavailable." "If all segments are mapped to the same reference, the unsigned observed template length equals the number of bases from the leftmost mapped base to the rightmost mapped base."
-	sam.SEQ = pid.supports[isup].readSequence; //pid.sequence minus white-space
-	sam.QUAL = "*"; //"*" "ASCII of base QUALity plus 33...This field can be a '*' when quality is not stored. If not a '*', SEQ must not be a '*' and the length of the quality string ought to equal the length of SEQ."
-	sam.optional = "PG:Z:Pindel"; 
-	if ( iscomplex )	sam.optional += ",CI:Z:"+sam.CIGAR;
+	size_t i = 0;
+	while ( i < len && !is_white( p[i] ) )
+		i++;
+	return i;
 }
 
-std::string create_CIGAR( std::string type , std::string size , std::string NTsize , int readLength , int readIndelLeftPos , bool& iscomplex )
+size_t scan_nonspace_scalar( const char* p , size_t len )
 {
-	std::string cigar;
-	std::string finalM;
-
-	cigar = int2str( readIndelLeftPos ) + "M";
-	if ( type[0] == 'D' && str2int( NTsize ) > 0 ) //complex indel
-	{
-		cigar += NTsize+"I"+size+"D";
-		finalM = int2str( readLength - readIndelLeftPos - str2int( NTsize ) ); //total-left-insert = right
-		cigar += finalM+"M";
+	size_t i = 0;
+	while ( i < len && is_white( p[i] ) )
+		i++;
+	return i;
+}
 
-		iscomplex = true;
+size_t scan_newline_scalar( const char* p , size_t len )
+{
+	const char* eol = (const char*)memchr( p , '\n' , len );
+	return eol ? eol-p : len;
+}
 
-		return cigar;
-	}
-	else
+#ifdef PINDEL2SAM_SIMD
+//the tails are finished here rather than in another scanner: calling legacy SSE code
+//with the upper AVX state dirty costs more than the scan itself
+__attribute__((target("sse4.2")))
+size_t scan_space_sse42( const char* p , size_t len )
+{
+	const __m128i ranges = _mm_setr_epi8( '\t' , '\r' , ' ' , ' ' , 0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 );
+	size_t i = 0;
+	for ( ; i+16 <= len; i += 16 )
 	{
-		if ( str2int( NTsize ) > 0 ) //if insertion
-		{
-			cigar += NTsize + "I";
-			finalM = int2str( readLength - readIndelLeftPos - str2int( NTsize ) );
-		}
-		if ( type[0] == 'D' ) //if deletion
-		{
-			cigar += size+type; //deletion size
-			finalM = int2str( readLength - readIndelLeftPos );
-		}
-
-		return cigar += finalM+"M";
+		int at = _mm_cmpestri( ranges , 4 , _mm_loadu_si128( (const __m128i*)( p+i ) ) , 16 , _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT );
+		if ( at < 16 )
+			return i+at;
 	}
+	while ( i < len && !is_white( p[i] ) )
+		i++;
+	return i;
 }
 
-std::string determine_POS( const std::string indelPos , const int leftof )
+__attribute__((target("sse4.2")))
+size_t scan_nonspace_sse42( const char* p , size_t len )
 {
-	return int2str( str2int( indelPos ) - leftof + 1 );
+	const __m128i ranges = _mm_setr_epi8( '\t' , '\r' , ' ' , ' ' , 0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 );
+	size_t i = 0;
+	for ( ; i+16 <= len; i += 16 )
+	{
+		int at = _mm_cmpestri( ranges , 4 , _mm_loadu_si128( (const __m128i*)( p+i ) ) , 16 , _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT );
+		if ( at < 16 )
+			return i+at;
+	}
+	while ( i < len && is_white( p[i] ) )
+		i++;
+	return i;
 }
 
-void set_support( std::ifstream& file , int Isize , struct support_data& support , std::map<std::string,std::string>& sm , std::map<std::string,int>& om , const int lrl )
+__attribute__((target("sse4.2")))
+size_t scan_newline_sse42( const char* p , size_t len )
 {
-	char dummy;
-	int eat = 0;
-	std::string line, temppm, tempn1, tempn2;
-	std::string readLeft, readRight;
-	std::map<std::string,int>::iterator omitlast = om.end();
-
-	if ( Isize > 0 ) //read is continuous
+	const __m128i newline = _mm_set1_epi8( '\n' );
+	size_t i = 0;
+	for ( ; i+16 <= len; i += 16 )
 	{
-		file >> std::noskipws >> dummy;
-		while ( isspace( dummy ) ) //need white space to get POS
-		{
-			file >> dummy;
-			eat++;
-		}
-		support.leftOfIndel = lrl -eat;
-		file >> std::skipws >> line;
-		support.readSequence = dummy+line;
+		int mask = _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i*)( p+i ) ) , newline ) );
+		if ( mask )
+			return i+__builtin_ctz( mask );
 	}
-	else //read has gap
-	{
-		file >> readLeft >> readRight;
-		support.leftOfIndel = readLeft.length();
-		support.readSequence = readLeft+readRight;
-	}//if has gap
+	while ( i < len && p[i] != '\n' )
+		i++;
+	return i;
+}
 
-	file >> temppm >> tempn1 >> tempn2; //+- num num
-	file >> support.readBAMsource;
-	if ( om.find( sm[support.readBAMsource] ) == omitlast ) //find returns om.end() if key not found
-	{//Error readBAMsource not in the map
-		std::cout << "PINDEL2SAM_ERROR: readBAMsource not in the map: ";
-		std::cout << support.readBAMsource << "\n\tbad line read as ";
-		std::cout << support.readSequence << "\t" << temppm << "\t";
-		std::cout << tempn1 << "\t" << tempn2 << "\t" << support.readBAMsource;
-		std::cout << "\nSkipping support for this read from line = ";
-		std::cout << linenum << std::endl;
-		std::getline( file , line );
+__attribute__((target("avx2")))
+static inline unsigned space_mask_avx2( const char* p )
+{
+	const __m256i space = _mm256_set1_epi8( ' ' ), tab = _mm256_set1_epi8( '\t' ), span = _mm256_set1_epi8( '\r'-'\t' );
+	__m256i c = _mm256_loadu_si256( (const __m256i*)p );
+	__m256i t = _mm256_sub_epi8( c , tab ); //'\t'..'\r' become 0..4
+	__m256i white = _mm256_or_si256( _mm256_cmpeq_epi8( c , space ) , _mm256_cmpeq_epi8( _mm256_min_epu8( t , span ) , t ) );
+	return (unsigned)_mm256_movemask_epi8( white );
+}
 
-		value = 3;
-	}
-	else
+__attribute__((target("avx2")))
+size_t scan_space_avx2( const char* p , size_t len )
+{
+	size_t i = 0;
+	for ( ; i+32 <= len; i += 32 )
 	{
-		file >> support.readBarcode;
-
-		support.readBarcode.erase( 0 , 1 ); //removes @ from beginning
-		support.readBarcode.erase( (size_t)(support.readBarcode.length()-2) , 2 ); //removes /1 or /2 from ending
-
-		std::getline( file , line ); //finish line to advance
-
-		value = 0;
+		unsigned mask = space_mask_avx2( p+i );
+		if ( mask )
+			return i+__builtin_ctz( mask );
 	}
+	while ( i < len && !is_white( p[i] ) )
+		i++;
+	return i;
 }
 
-void set_supports( std::ifstream& file , struct pindel_fields& pid , std::map<std::string,std::string>& sm , std::map<std::string,int>& om , const int lrl )
+__attribute__((target("avx2")))
+size_t scan_nonspace_avx2( const char* p , size_t len )
 {
-	struct support_data sd;
-	int eat;
-	std::string line, readLeft, readRight;
-	bool hasgap;
-
-	for ( unsigned supportIndex = 0; supportIndex < str2int( pid.NumSupports ); supportIndex++ )
+	size_t i = 0;
+	for ( ; i+32 <= len; i += 32 )
 	{
-		clear_support_data( sd ); //support data
-		set_support( file , str2int( pid.NT_size ) , sd , sm , om , lrl );
-		linenum++;
+		unsigned mask = ~space_mask_avx2( p+i );
+		if ( mask )
+			return i+__builtin_ctz( mask );
+	}
+	while ( i < len && is_white( p[i] ) )
+		i++;
+	return i;
+}
+
+__attribute__((target("avx2")))
+size_t scan_newline_avx2( const char* p , size_t len )
+{
+	const __m256i newline = _mm256_set1_epi8( '\n' );
+	size_t i = 0;
+	for ( ; i+32 <= len; i += 32 )
+	{
+		unsigned mask = (unsigned)_mm256_movemask_epi8( _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i*)( p+i ) ) , newline ) );
+		if ( mask )
+			return i+__builtin_ctz( mask );
+	}
+	while ( i < len && p[i] != '\n' )
+		i++;
+	return i;
+}
+#endif
+
+void skip_to_separation( struct pindel_reader& file )
+{
+	struct text_span line;
+	while ( file.cur < file.end && *file.cur != '#' )
+	{
+		next_line( file , line );
+		file.linenum++;
+	}
+}
+
+const char* find_separation( const char* p , const char* begin , const char* end )
+{
+	if ( p > begin && p[-1] != '\n' ) //inside a line, start at the next one
+		p += scan_newline( p , end-p )+1;
+	while ( p < end && *p != '#' )
+		p += scan_newline( p , end-p )+1;
+
+	return std::min( p , end );
+}
+
+int line_number( struct pindel_reader& file )
+{
+	if ( file.linebase < 0 )
+		file.linebase = chunk_line_base( *file.chunks , file.chunk );
+
+	return file.linebase+file.linenum;
+}
+
+/* COMPRESSED INPUT */
+bool inflate_more( struct pindel_reader& file , std::string& text )
+{
+	struct gzip_input& gz = *file.gz;
+	size_t length = text.length();
+	int status;
+
+	if ( gz.finished )
+		return false;
+	if ( !gz.started )
+	{
+		memset( &gz.stream , 0 , sizeof( gz.stream ) );
+		if ( inflateInit2( &gz.stream , 15+16 ) != Z_OK ) //gzip wrapper
+		{
+			*file.log << "PINDEL2SAM_ERROR: could not start inflating " << file.filename << std::endl;
+			gz.finished = true;
+			return false;
+		}
+		gz.started = true;
+	}
+	text.resize( length+INFLATESIZE );
+	gz.stream.next_out = (Bytef*)&text[length];
+	gz.stream.avail_out = INFLATESIZE;
+	while ( gz.stream.avail_out > 0 && !gz.finished )
+	{
+		if ( gz.stream.avail_in == 0 ) //zlib counts input in 32 bits, feed large files a slice at a time
+		{
+			gz.stream.next_in = (Bytef*)file.data+gz.consumed;
+			gz.stream.avail_in = std::min( file.size-gz.consumed , (size_t)1<<30 );
+			gz.consumed += gz.stream.avail_in;
+		}
+		status = inflate( &gz.stream , Z_NO_FLUSH );
+		if ( status == Z_STREAM_END ) //bgzip and concatenated files hold several gzip members
+		{
+			if ( gz.stream.avail_in == 0 && gz.consumed == file.size )
+				gz.finished = true;
+			else
+				inflateReset( &gz.stream );
+		}
+		else if ( status != Z_OK )
+		{//Error damaged or cut short
+			*file.log << "PINDEL2SAM_ERROR: could not inflate " << file.filename << " at " << gz.consumed-gz.stream.avail_in << std::endl;
+			gz.finished = true;
+		}
+	}
+	text.resize( length+INFLATESIZE-gz.stream.avail_out );
+
+	return text.length() > length || !gz.finished;
+}
+
+bool next_piece( struct pindel_reader& file , std::string& text )
+{
+	struct gzip_input& gz = *file.gz;
+	size_t cut;
+
+	text.swap( gz.carry );
+	gz.carry.clear();
+	while ( text.length() < CHUNKSIZE && inflate_more( file , text ) )
+		;
+	while ( ( cut = text.rfind( "\n#" ) ) == std::string::npos && inflate_more( file , text ) ) //one event longer than a piece
+		;
+	if ( gz.finished || cut == std::string::npos )
+		return !text.empty();
+	gz.carry.assign( text , cut+1 , std::string::npos ); //the last event may not be complete
+	text.erase( cut+1 );
+
+	return true;
+}
+
+bool index_bgzf( struct pindel_reader& file )
+{
+	std::vector<size_t>& blocks = file.gz->blocks;
+	const unsigned char* p;
+	size_t offset = 0, bsize;
+
+	blocks.clear();
+	while ( offset < file.size )
+	{
+		p = (const unsigned char*)file.data+offset;
+		if ( file.size-offset < 28 || p[0] != 31 || p[1] != 139 || p[2] != 8 || !( p[3] & 4 ) ||
+		     p[10] != 6 || p[11] != 0 || p[12] != 'B' || p[13] != 'C' || p[14] != 2 || p[15] != 0 )
+			break; //not a BGZF block header
+		bsize = ( p[16] | p[17] << 8 )+1;
+		if ( bsize < 28 || bsize > file.size-offset )
+			break;
+		blocks.push_back( offset );
+		offset += bsize;
+	}
+	if ( offset != file.size || blocks.empty() )
+	{
+		blocks.clear();
+		return false;
+	}
+	blocks.push_back( offset );
+
+	return true;
+}
+
+bool inflate_block( z_stream& stream , const char* block , size_t bsize , std::string& text )
+{
+	const unsigned char* tail = (const unsigned char*)block+bsize-8;
+	uint32_t crc = tail[0] | tail[1] << 8 | tail[2] << 16 | (uint32_t)tail[3] << 24;
+	uint32_t isize = tail[4] | tail[5] << 8 | tail[6] << 16 | (uint32_t)tail[7] << 24;
+	size_t length = text.length();
+
+	if ( isize > 0x10000 )
+		return false;
+	text.resize( length+isize );
+	inflateReset( &stream );
+	stream.next_in = (Bytef*)block+18;
+	stream.avail_in = bsize-26;
+	stream.next_out = (Bytef*)&text[length];
+	stream.avail_out = isize;
+	if ( inflate( &stream , Z_FINISH ) != Z_STREAM_END || stream.avail_out != 0 ||
+	     crc32( crc32( 0L , Z_NULL , 0 ) , (const Bytef*)text.data()+length , isize ) != crc )
+	{
+		text.resize( length );
+		return false;
+	}
+
+	return true;
+}
+
+void inflate_piece( struct chunk_queue& cq , unsigned c )
+{
+	struct pindel_chunk& pc = cq.chunks[c];
+	const struct pindel_reader& file = *pc.file;
+	const std::vector<size_t>& blocks = file.gz->blocks;
+	unsigned b = pc.block, last = blocks.size()-1;
+	bool first = ( c == 0 || cq.chunks[c-1].file != pc.file ), ok = true;
+	size_t blockText, begin = 0, end, cut;
+	std::ostringstream log;
+	z_stream stream;
+
+	memset( &stream , 0 , sizeof( stream ) );
+	inflateInit2( &stream , -15 ); //raw deflate, the block header is skipped
+	for ( ; b < pc.blockEnd && ok; b++ )
+		ok = inflate_block( stream , file.data+blocks[b] , blocks[b+1]-blocks[b] , pc.text );
+	blockText = pc.text.length();
+	if ( !first ) //starts at the first # line after the start of its blocks, as the previous piece ends
+	{
+		while ( ( cut = pc.text.find( "\n#" ) ) == std::string::npos && b < last && ok )
+			ok = inflate_block( stream , file.data+blocks[b] , blocks[b+1]-blocks[b] , pc.text ), b++;
+		begin = ( cut == std::string::npos ) ? pc.text.length() : cut+1;
+	}
+	while ( ( cut = pc.text.find( "\n#" , blockText ) ) == std::string::npos && b < last && ok ) //ends at the first # line after its blocks
+		ok = inflate_block( stream , file.data+blocks[b] , blocks[b+1]-blocks[b] , pc.text ), b++;
+	end = ( cut == std::string::npos ) ? pc.text.length() : cut+1;
+	inflateEnd( &stream );
+	if ( !ok )
+		log << "PINDEL2SAM_ERROR: could not inflate " << file.filename << " at " << blocks[b-1] << std::endl;
+
+	pthread_mutex_lock( &chunkLock );
+	pc.blockLines = std::count( pc.text.begin() , pc.text.begin()+blockText , '\n' );
+	pc.headLines = std::count( pc.text.begin() , pc.text.begin()+begin , '\n' );
+	pc.counted = true;
+	pc.log = log.str();
+	pthread_cond_broadcast( &chunkDone );
+	pthread_mutex_unlock( &chunkLock );
+	pc.begin = pc.text.data()+begin;
+	pc.end = pc.text.data()+std::max( begin , end );
+}
+
+void convert_compressed( struct pindel_reader& file , const struct header& h , std::map<std::string,std::string>& sm , std::map<std::string,int>& om , std::vector<struct record_batch>& batches )
+{
+	struct pindel_reader piece = file;
+	std::string text;
+
+	piece.linebase = 0;
+	while ( next_piece( file , text ) )
+	{
+		piece.data = piece.cur = text.data();
+		piece.end = text.data()+text.length();
+		piece.linebase += piece.linenum;
+		piece.linenum = 0;
+		convert_events( piece , h , sm , om , batches , true );
+	}
+}
+
+bool check_ending( const std::string filename )
+{
+	std::string name = filename;
+	if ( name.length() > 3 && name.compare( name.length()-3 , 3 , ".gz" ) == 0 ) //compressed Pindel output
+		name.erase( name.length()-3 );
+	int fnlen = name.length()-1;
+	if ( ( name[fnlen] == 'D' && name[fnlen-1] == '_' ) || 
+	     ( name[fnlen] == 'I' && name[fnlen-1] == 'S' && name[fnlen-2] == '_' ) )
+		return true;
+	else
+		return false;
+}
+
+int check_separation( struct pindel_reader& file , const struct text_span& line )
+{
+	struct text_span rest = line, pounds;
+
+	file.linenum++;
+	if ( !next_token( rest , pounds ) || pounds.ptr[0] != '#' )
+		pounds.len = 0;
+	if ( pounds.len != (size_t)NUMBEROFPOUNDS )
+	{
+		*file.log << "PINDEL2SAM_ERROR: bad number of #'s = " << pounds.len << " on line = " << line_number( file ) << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int read_config_file( const std::string& filename , std::map<std::string,std::string>& sampleMap , std::map<std::string,int>& outputMap )
+{
+	std::ifstream file( filename.c_str() );
+	int numsamples = 0;
+
+	if ( file.good() )//successfully opened config file
+	{
+		std::cout << "\t\tOpened: " << filename << std::endl;
+
+		std::string name, sample, temp;
+		while ( file >> name >> temp >> sample )
+		{
+			for ( int c = 0; c < name.length(); c++ )
+			{
+				if ( (char)name[c] == '/' )
+					name[c] = '_';
+			}
+			sampleMap[sample] = name;
+			outputMap[name] = numsamples++;
+		}
+
+		file.close();
+		std::cout << "\t\t\t\tClosed: " << filename << std::endl;
+
+		return numsamples;
+	}
+	else
+	{//Error opening config file
+		std::cout << "PINDEL2SAM_ERROR: could not open " << filename << std::endl;
+
+		return numsamples;
+	}
+}
+
+void merge_outputs( struct header& h , std::map<std::string,std::string>& sampleMap , std::map<std::string,int>& outputMap )
+{
+	outputMap.clear();
+	outputMap[mergedOutput] = 0;
+	for ( std::map<std::string,std::string>::iterator sit = sampleMap.begin(); sit != sampleMap.end(); ++sit )
+	{
+		sit->second = mergedOutput;
+		h.custom += "@RG\tID:"+sit->first+"\tSM:"+sit->first+"\n"; //after the @SQ lines
+	}
+	std::cout << "\t\tMerging " << sampleMap.size() << " samples into " << mergedOutput << std::endl;
+}
+
+int read_fafai_file( const std::string& filename , struct header& h )
+{
+	std::ifstream file( filename.c_str() );
+	std::string chr, chrlen, temp;
+	int numrefs = 0;
+
+	if ( file.good() )
+	{
+		std::cout << "\t\tOpened: " << filename << std::endl;
+
+		h.top = "@HD\tVN:"+SAMVERSION+"\n";
+		while ( file >> chr >> chrlen >> temp >> temp >> temp )
+		{
+				h.refLen.push_back( str2int( chrlen ) );
+				h.chrOrder.push_back( chr );
+				set_header_custom( h , chr );
+			numrefs++;
+		}
+		set_header_bottom( h );
+		build_reference_table( h );
+
+		file.close();
+		std::cout << "\t\t\t\tClose: " << filename << std::endl;
+
+		return numrefs;
+	}
+	else
+	{//Error opening reference index file
+		std::cout << "PINDEL2SAM_ERROR: could not open " << filename << std::endl;
+
+		return numrefs;
+	}
+}
+
+void set_header_custom( struct header& h , const std::string& chr )
+{
+	h.custom += "@SQ\tSN:"+chr+"\tLN:"+int2str( h.refLen.back() )+"\n";
+}
+
+uint32_t reference_hash( const char* name , size_t len ) //FNV-1a
+{
+	uint32_t hash = 2166136261u;
+
+	for ( size_t c = 0; c < len; c++ )
+		hash = ( hash ^ (unsigned char)name[c] ) * 16777619u;
+	return hash;
+}
+
+void build_reference_table( struct header& h )
+{
+	size_t size = 16;
+
+	while ( size < 2*h.chrOrder.size() ) //at most half full
+		size <<= 1;
+	h.refTable.assign( size , -1 );
+	for ( unsigned r = 0; r < h.chrOrder.size(); r++ )
+	{
+		size_t slot = reference_hash( h.chrOrder[r].data() , h.chrOrder[r].length() ) & ( size-1 );
+		while ( h.refTable[slot] >= 0 && h.chrOrder[h.refTable[slot]] != h.chrOrder[r] )
+			slot = ( slot+1 ) & ( size-1 );
+		h.refTable[slot] = r; //a name listed twice keeps its last position
+	}
+}
+
+int find_reference( const struct header& h , const char* name , size_t len )
+{
+	size_t mask = h.refTable.size()-1;
+	size_t slot = reference_hash( name , len ) & mask;
+
+	if ( h.refTable.empty() ) //no reference index was read
+		return -1;
+	for ( ; h.refTable[slot] >= 0; slot = ( slot+1 ) & mask )
+	{
+		const std::string& chr = h.chrOrder[h.refTable[slot]];
+		if ( chr.length() == len && memcmp( chr.data() , name , len ) == 0 )
+			return h.refTable[slot];
+	}
+	return -1;
+}
+
+void set_header_bottom( struct header& h )
+{
+	h.bottom = "@PG\tPN:Pindel\tVN:"+PINDELVERSION+"\n";
+}
+
+int set_pindel_fields( struct pindel_reader& file , struct text_span line , const struct header& h , struct pindel_fields& pid )
+{
+	struct text_span field;
+
+	pid.supportsRead = 0;
+	arena_reset( pid.arena );
+	file.linenum++;
+
+	skip_tokens( line , 1 ); //SVIndex
+	next_token( line , field );
+	pid.indelType = field.len > 0 ? field.ptr[0] : ' ';
+	next_token( line , field );
+	pid.indelSize = span2int( field );
+	skip_tokens( line , 1 ); //NT
+	next_token( line , field );
+	pid.NT_size = span2int( field );
+	next_token( line , pid.NT_sequence );
+	if ( pid.NT_size < 0 || pid.NT_sequence.len != (size_t)pid.NT_size+2 ) //quoted, so two longer than NT_size
+	{//Error NT sequence/size mismatch
+		*file.log << "PINDEL2SAM_ERROR: NT sequence/size mismatch ( " << pid.NT_sequence.len << " ";
+		*file.log << pid.NT_size << " )\nSkipping support from line = " << line_number( file ) << std::endl;
+
+		return 1;
+	}
+	skip_tokens( line , 1 ); //Chr
+	next_token( line , pid.chrID );
+	pid.refID = find_reference( h , pid.chrID.ptr , pid.chrID.len );
+	if ( pid.refID < 0 )
+	{//Error event on a contig the outputs cannot hold
+		*file.log << "PINDEL2SAM_ERROR: " << std::string( pid.chrID.ptr , pid.chrID.len ) << " is not in the reference index\nSkipping supports from line = " << line_number( file ) << std::endl;
+
+		return 3;
+	}
+	skip_tokens( line , 1 ); //BP
+	next_token( line , field );
+	pid.BPLeft_plus_one = span2int( field );
+	skip_tokens( line , 5 ); //BPright BP_range left right NumSupports
+	next_token( line , field );
+	pid.NumSupports = span2int( field );
+	skip_tokens( line , 13 );
+	if ( !next_token( line , field ) )
+	{//Error line ended early
+		*file.log << "PINDEL2SAM_ERROR: summary too short\nSkipping supports from line = " << line_number( file ) << std::endl;
+
+		return 2;
+	}
+	pid.NumSupSamples = span2int( field );
+	if ( pid.NumSupSamples > NUMBEROFSAMPLES )
+	{//Error number of samples mismatch
+		*file.log << "PINDEL2SAM_ERROR: Number of samples mismatch\nSkipping supports from line = " << line_number( file ) << std::endl;
+
+		return 2;
+	}
+
+	return 0;
+	//check specific header sequences
+}
+
+int set_reference_detail( struct pindel_reader& file , struct pindel_fields& pid )
+{
+	struct text_span line, left;
+
+	file.linenum++;
+	if ( !next_line( file , line ) )
+		return 0;
+	if ( pid.NT_size > 0 ) //gap in reference
+	{
+		next_token( line , left ); //left half, the right half is not needed
+
+		return left.len;
+	}
+	else //no gap in reference
+	{
+		return line.len; //no info to get, eat whole line
+	}
+}
+
+void event_conversion( const struct pindel_fields& pid , const struct header& h , struct sam_event& ev )
+{
+	ev.refID = pid.refID;
+	ev.flagColumns = "\t";
+	append_decimal( ev.flagColumns , SAMFLAG );
+	ev.flagColumns += "\t"+h.chrOrder[ev.refID]+"\t";
+	ev.pack = NULL;
+	if ( pid.indelType == 'D' )
+		ev.pack = pid.NT_size > 0 ? &pack_CIGAR<CIGARCOMPLEX> : &pack_CIGAR<CIGARDELETION>;
+	else if ( pid.NT_size > 0 )
+		ev.pack = &pack_CIGAR<CIGARINSERTION>;
+	ev.complex = ( ev.pack == &pack_CIGAR<CIGARCOMPLEX> );
+	ev.longReference = (int64_t)h.refLen[ev.refID]+256 > (int64_t)1 << ( INDEXMINSHIFT+3*BAILEVELS ); //as index_levels measures it
+}
+
+void field_conversion( const struct pindel_fields& pid , int isup , const struct sam_event& ev , struct sam_fields& sam )
+{
+	const struct support_data& support = pid.supports[isup];
+
+	sam.QNAME = support.readBarcode;
+	sam.POS = determine_POS( pid.BPLeft_plus_one , support.leftOfIndel );
+	sam.CIGARops = ev.pack ? ev.pack( sam.CIGAR , support.readSequence.len , support.leftOfIndel , pid.indelSize , pid.NT_size ) : 0;
+	sam.SEQ = support.readSequence; //pid.sequence minus white-space
+	sam.RG = support.readBAMsource;
+	if ( mergedOutput.empty() )
+		sam.RG.len = 0;
+}
+
+template <int kind>
+int pack_CIGAR( uint32_t* ops , int readLength , int readIndelLeftPos , int size , int NTsize )
+{
+	int finalM = readLength - readIndelLeftPos, n = 0;
+
+	if ( kind != CIGARDELETION ) //inserted bases are not in the final M
+		finalM -= NTsize;
+	if ( readIndelLeftPos < 0 || readIndelLeftPos >= (1<<28) || finalM < 0 || finalM >= (1<<28) )
+		return 0;
+	ops[n++] = (uint32_t)readIndelLeftPos << 4; //M
+	if ( kind != CIGARDELETION )
+	{
+		if ( NTsize < 0 || NTsize >= (1<<28) )
+			return 0;
+		ops[n++] = (uint32_t)NTsize << 4 | 1; //I
+	}
+	if ( kind != CIGARINSERTION )
+	{
+		if ( size < 0 || size >= (1<<28) )
+			return 0;
+		ops[n++] = (uint32_t)size << 4 | 2; //D
+	}
+	ops[n++] = (uint32_t)finalM << 4; //M
+
+	return n;
+}
+
+void append_CIGAR( std::string& out , const uint32_t* ops , int n )
+{
+	for ( int o = 0; o < n; o++ )
+	{
+		append_decimal( out , ops[o] >> 4 );
+		out += BAMCIGAROPS[ops[o] & 0xf];
+	}
+}
+
+int determine_POS( int indelPos , int leftof )
+{
+	return indelPos - leftof + 1;
+}
+
+char* arena_alloc( struct event_arena& arena , size_t len )
+{
+	char* bytes;
+
+	while ( arena.block < arena.blocks.size() && arena.used+len > arena.blocks[arena.block].second ) //try the next kept block
+	{
+		arena.block++;
+		arena.used = 0;
+	}
+	if ( arena.block == arena.blocks.size() ) //every block is full
+	{
+		size_t size = std::max( len , ARENABLOCKSIZE );
+		arena.blocks.push_back( std::make_pair( new char[size] , size ) );
+		arena.used = 0;
+	}
+	bytes = arena.blocks[arena.block].first+arena.used;
+	arena.used += len;
+
+	return bytes;
+}
+
+void arena_reset( struct event_arena& arena )
+{
+	arena.block = 0;
+	arena.used = 0;
+}
+
+void arena_free( struct event_arena& arena )
+{
+	for ( unsigned b = 0; b < arena.blocks.size(); b++ )
+		delete [] arena.blocks[b].first;
+	arena.blocks.clear();
+	arena_reset( arena );
+}
+
+int set_support( struct pindel_reader& file , struct text_span line , struct pindel_fields& pid , struct support_data& support , std::map<std::string,std::string>& sm , std::map<std::string,int>& om , const int lrl )
+{
+	struct text_span readLeft, readRight, temppm, tempn1, tempn2, field;
+	std::map<std::string,std::string>::iterator smit;
+	std::map<std::string,int>::iterator omit;
+
+	if ( pid.NT_size > 0 ) //read is continuous
+	{
+		int eat = skip_tokens( line , 0 ); //need white space to get POS
+		support.leftOfIndel = lrl -eat;
+		next_token( line , support.readSequence );
+	}
+	else //read has gap
+	{
+		char* joined;
+		next_token( line , readLeft );
+		next_token( line , readRight );
+		support.leftOfIndel = readLeft.len;
+		joined = arena_alloc( pid.arena , readLeft.len+readRight.len );
+		memcpy( joined , readLeft.ptr , readLeft.len );
+		memcpy( joined+readLeft.len , readRight.ptr , readRight.len );
+		support.readSequence.ptr = joined;
+		support.readSequence.len = readLeft.len+readRight.len;
+	}//if has gap
+
+	next_token( line , temppm ); //+- num num
+	next_token( line , tempn1 );
+	next_token( line , tempn2 );
+	next_token( line , support.readBAMsource );
+	span2str( support.readBAMsource , pid.sample );
+	smit = sm.find( pid.sample ); //find, not [], the maps are shared by parse threads
+	if ( smit == sm.end() || ( omit = om.find( smit->second ) ) == om.end() ) //find returns end() if key not found
+	{//Error readBAMsource not in the map
+		*file.log << "PINDEL2SAM_ERROR: readBAMsource not in the map: ";
+		*file.log << pid.sample << "\n\tbad line read as ";
+		*file.log << std::string( support.readSequence.ptr , support.readSequence.len ) << "\t" << std::string( temppm.ptr , temppm.len ) << "\t";
+		*file.log << std::string( tempn1.ptr , tempn1.len ) << "\t" << std::string( tempn2.ptr , tempn2.len ) << "\t" << pid.sample;
+		*file.log << "\nSkipping support for this read from line = ";
+		*file.log << line_number( file ) << std::endl;
+
+		return 3;
+	}
+	else
+	{
+		support.output = omit->second;
+		next_token( line , field );
+		support.readBarcode.ptr = field.ptr+1; //removes @ from beginning and /1 or /2 from ending
+		support.readBarcode.len = field.len > 3 ? field.len-3 : 0;
+
+		return 0;
+	}
+}
+
+void set_supports( struct pindel_reader& file , struct pindel_fields& pid , std::map<std::string,std::string>& sm , std::map<std::string,int>& om , const int lrl )
+{
+	struct text_span line;
+	int value;
+
+	for ( int supportIndex = 0; supportIndex < pid.NumSupports; supportIndex++ )
+	{
+		if ( file.cur < file.end && *file.cur == '#' ) //fewer supports than listed
+			break;
+		if ( !next_line( file , line ) )
+			break;
+		if ( pid.supportsRead == pid.supports.size() ) //grows only past the most supports seen so far
+			pid.supports.resize( pid.supportsRead+1 );
+		value = set_support( file , line , pid , pid.supports[pid.supportsRead] , sm , om , lrl );
+		file.linenum++;
 		if ( value == 0 ) //Support was read successfully
 		{
-			pid.supports.push_back( sd );
+			pid.supportsRead++;
+		}
+		else if ( file.cur < file.end && *file.cur != '#' )
+		{//Error from set_suport skip to end of supports
+			next_line( file , line ); //could try another method of finding the next good line
+			file.linenum++;
+			supportIndex++;
+		}
+	}
+}
+
+void print_update( int line , int& next )
+{
+	if ( line == 0 )
+		std::cout << "\t\t\tConverting.\n";
+	else if ( line >= next )
+	{
+		std::cout << "\t\t\tStill converting. At line " << line << "." << std::endl;
+		next += UPDATEFREQUENCY;
+	}
+}
+
+void print_header( const struct header& h )
+{
+	std::cout << h.top << h.custom << h.bottom;
+}
+
+void print_pindel_fields( const struct pindel_fields& pid )
+{
+	std::cout << pid.indelType << '\t' << pid.indelSize << '\t';
+	std::cout << pid.NT_size << std::string( pid.NT_sequence.ptr , pid.NT_sequence.len ) << '\t';
+	std::cout << std::string( pid.chrID.ptr , pid.chrID.len ) << '\t' << pid.BPLeft_plus_one << '\t';
+	std::cout << pid.NumSupports << '\t' << pid.NumSupSamples << std::endl;
+	print_supports( pid.supports , pid.supportsRead );
+}
+
+void print_support_with_summary( const struct pindel_fields& pid , int isup )
+{
+	std::cout << pid.indelType << '\t' << pid.indelSize << '\t';
+	std::cout << pid.NT_size << std::string( pid.NT_sequence.ptr , pid.NT_sequence.len ) << '\t';
+	std::cout << std::string( pid.chrID.ptr , pid.chrID.len ) << '\t' << pid.BPLeft_plus_one << '\t';
+	std::cout << pid.NumSupports << '\t' << pid.NumSupSamples << std::endl;
+	print_support_data( pid.supports[isup] );
+}
+
+void print_support_data( const struct support_data& sd )
+{
+	std::cout << sd.leftOfIndel << '\t' << std::string( sd.readSequence.ptr , sd.readSequence.len ) << '\t';
+	std::cout << std::string( sd.readBAMsource.ptr , sd.readBAMsource.len ) << '\t' << std::string( sd.readBarcode.ptr , sd.readBarcode.len ) << '\n';
+}
+
+void print_supports( const std::vector<struct support_data>& supports , unsigned count )
+{
+	unsigned i = 0;
+	while ( i < count )
+	{
+		print_support_data( supports[i] );
+		i++;
+	}
+}
+
+void print_sam( const struct sam_event& ev , const struct sam_fields& sam )
+{
+	struct record_batch batch;
+	std::ostringstream log;
+
+	save_sam( ev , sam , false , batch , log );
+	std::cout << batch.data << std::flush;
+}
+
+void save_header( const struct header& h , std::map<std::string,std::string>& sampleMap , std::map<std::string,int>& outputMap )
+{
+	std::string outname;
+	struct header oh = h;
+	if ( sortOutput )
+		oh.top = "@HD\tVN:"+SAMVERSION+"\tSO:coordinate\n";
+	outputWriters.resize( NUMBEROFSAMPLES );
+	for ( std::map<std::string,std::string>::iterator sit = sampleMap.begin(); sit!=sampleMap.end(); ++sit )
+	{
+		struct sam_writer& w = outputWriters[outputMap[sit->second]];
+		if ( !w.filename.empty() ) //already opened for another sample with the same output
+			continue;
+		outname = outputDirectoryName+( sit->second )+( sortOutput ? ".sorted." : "." )+outputFormat;
+		w.filename = outname;
+		w.bgzf = ( outputFormat == "bam" );
+		w.indexed = w.bgzf && sortOutput;
+		if ( w.indexed )
+		{
+			w.index.levels = index_levels( h );
+			w.index.refs.resize( h.chrOrder.size() );
+		}
+		if ( shardOutput ) //shards are opened as their records are merged
+		{
+			w.shardBase = outputDirectoryName+( sit->second );
+			w.shardRef = -1;
+			if ( w.bgzf )
+				bam_header( oh , w.header );
+			else
+				w.header = oh.top + oh.custom + oh.bottom;
+			std::cout << "\t\tSharding output by chromosome: " << w.shardBase << ".<chr>.sorted." << outputFormat << std::endl;
+			continue;
+		}
+		struct stat st;
+		if ( stat( outname.c_str() , &st ) == 0 && !sortOutput ) //file existed
+		{
+			if ( resuming )
+				std::cout << "\t\tResuming output file: " << outname << std::endl;
+			else
+			{
+				std::cout << "PINDEL2SAM_WARNING: File exists: " << outname;
+				std::cout << "\n\tAssuming header present. Will append to existing files.\n";
+			}
+			w.created = true;
+			open_writer( w );
+		}
+		else //file did not exist, or sorted output replaces it
+		{
+			if ( stat( outname.c_str() , &st ) == 0 )
+			{
+				std::cout << "PINDEL2SAM_WARNING: File exists: " << outname;
+				std::cout << "\n\tSorted output will replace it.\n";
+			}
+			w.created = false;
+			if ( open_writer( w ) ) //new file
+			{
+				std::cout << "\t\tInitializing output file: " << outname << std::endl;
+				if ( w.bgzf )
+					bam_header( oh , w.buffer );
+				else
+					w.buffer = oh.top + oh.custom + oh.bottom;
+			}
+		}
+		bufferMemoryUsed += w.buffer.length();
+	}//for each sample
+}
+
+void save_sam( const struct sam_event& ev , const struct sam_fields& sam , bool bgzf , struct record_batch& batch , std::ostream& log )
+{
+	std::string& out = batch.data;
+	struct sort_entry entry;
+	entry.offset = out.length();
+
+	if ( bgzf )
+	{
+		if ( bam_record( ev , sam , out ) != 0 )
+		{
+			std::string cigar;
+			append_CIGAR( cigar , sam.CIGAR , sam.CIGARops );
+			log << "PINDEL2SAM_ERROR: could not encode read " << std::string( sam.QNAME.ptr , sam.QNAME.len ) << " with CIGAR " << cigar << " as BAM" << std::endl;
+			return;
+		}
+	}
+	else
+	{
+		out.append( sam.QNAME.ptr , sam.QNAME.len );
+		out += ev.flagColumns;
+		append_decimal( out , sam.POS );
+		out += SAMMAPQCOLUMN;
+		append_CIGAR( out , sam.CIGAR , sam.CIGARops );
+		out += SAMMATECOLUMNS;
+		out.append( sam.SEQ.ptr , sam.SEQ.len );
+		out += SAMTAILCOLUMNS;
+		if ( ev.complex )
+		{
+			out += ",CI:Z:";
+			append_CIGAR( out , sam.CIGAR , sam.CIGARops );
+		}
+		if ( sam.RG.len > 0 )
+		{
+			out += "\tRG:Z:";
+			out.append( sam.RG.ptr , sam.RG.len );
+		}
+		out += '\n';
+	}
+	if ( sortOutput )
+	{
+		entry.key = sort_key( ev , sam );
+		entry.length = out.length()-entry.offset;
+		batch.entries.push_back( entry );
+	}
+}
+
+void commit_batches( std::vector<struct record_batch>& batches )
+{
+	if ( fragmentOut.file )
+		record_fragment( batches );
+	for ( unsigned i = 0; i < batches.size(); i++ )
+	{
+		struct record_batch& batch = batches[i];
+		struct sam_writer& w = outputWriters[i];
+		if ( batch.data.empty() )
+			continue;
+		if ( sortOutput )
+		{
+			size_t base = w.records.length();
+			w.records += batch.data;
+			for ( unsigned e = 0; e < batch.entries.size(); e++ )
+			{
+				batch.entries[e].offset += base;
+				w.entries.push_back( batch.entries[e] );
+				sortMemoryUsed += batch.entries[e].length+sizeof( struct sort_entry );
+			}
+			while ( sortMemoryUsed > sortMemory ) //spill the output holding the most records
+			{
+				unsigned largest = 0;
+				for ( unsigned o = 1; o < outputWriters.size(); o++ )
+				{
+					if ( outputWriters[o].records.length() > outputWriters[largest].records.length() )
+						largest = o;
+				}
+				if ( outputWriters[largest].records.empty() )
+					break;
+				spill_run( outputWriters[largest] );
+			}
+		}
+		else
+		{
+			size_t held = w.buffer.length();
+			w.buffer += batch.data;
+			if ( w.buffer.length() >= OUTPUTBUFFERSIZE ) //flush on size threshold
+				flush_writer( w , false );
+			bufferMemoryUsed = bufferMemoryUsed+w.buffer.length()-held;
+			if ( bufferMemoryUsed > sortMemory ) //many outputs, each below the threshold
+				flush_buffers();
+		}
+		batch.data.clear();
+		batch.entries.clear();
+	}
+}
+
+void flush_writer( struct sam_writer& w , bool final )
+{
+	size_t done = 0;
+
+	if ( w.bgzf ? ( final || w.buffer.length() >= BGZFBLOCKSIZE ) : !w.buffer.empty() ) //reopened only when something is written
+	{
+		open_writer( w );
+		w.synced = false;
+	}
+	if ( w.bgzf ) //compress whole blocks, keep the tail for the next flush
+	{
+		while ( w.buffer.length()-done >= BGZFBLOCKSIZE || ( final && done < w.buffer.length() ) )
+		{
+			size_t len = std::min( BGZFBLOCKSIZE , w.buffer.length()-done );
+			bgzf_submit( w , w.buffer.data()+done , len );
+			done += len;
+		}
+		w.ubase += done;
+		w.buffer.erase( 0 , done );
+		if ( final )
+		{
+			bgzf_submit( w , NULL , 0 ); //empty EOF block
+			bgzf_wait( w );
+		}
+		if ( w.indexed )
+			index_resolve( w );
+	}
+	else if ( !w.buffer.empty() )
+	{
+		if ( !w.file || fwrite( w.buffer.data() , 1 , w.buffer.length() , w.file ) != w.buffer.length() )
+		{//Error writing file
+			std::cout << "PINDEL2SAM_ERROR: Could not write to " << w.filename << std::endl;
+		}
+		w.buffer.clear();
+	}
+}
+
+void flush_buffers()
+{
+	while ( bufferMemoryUsed > sortMemory/2 ) //down to half, so the scan is not repeated for every batch
+	{
+		unsigned largest = 0;
+		for ( unsigned o = 1; o < outputWriters.size(); o++ )
+		{
+			if ( outputWriters[o].buffer.length() > outputWriters[largest].buffer.length() )
+				largest = o;
+		}
+		struct sam_writer& w = outputWriters[largest];
+		size_t held = w.buffer.length();
+		if ( held == 0 )
+			break;
+		flush_writer( w , false );
+		if ( w.buffer.length() == held ) //a BGZF tail shorter than a block
+			flush_tail( w );
+		bufferMemoryUsed -= held-w.buffer.length();
+	}
+}
+
+void flush_tail( struct sam_writer& w )
+{
+	if ( w.buffer.empty() )
+		return;
+	open_writer( w );
+	w.synced = false;
+	bgzf_submit( w , w.buffer.data() , w.buffer.length() ); //a short block, a later block follows it
+	w.ubase += w.buffer.length();
+	w.buffer.clear();
+	if ( w.indexed )
+		index_resolve( w );
+}
+
+bool open_writer( struct sam_writer& w )
+{
+	pthread_mutex_lock( &fileLock );
+	if ( w.file )
+	{
+		openWriters.splice( openWriters.begin() , openWriters , w.recent );
+		pthread_mutex_unlock( &fileLock );
+		return true;
+	}
+	std::list<struct sam_writer*>::iterator victim = openWriters.end();
+	while ( (int)openWriters.size() >= maxOpenOutputs && victim != openWriters.begin() ) //least recently written first
+	{
+		struct sam_writer& v = **--victim;
+		if ( v.busy )
+			continue;
+		victim++;
+		bgzf_wait( v ); //its blocks are written to the file being closed
+		release_writer( v );
+	}
+	w.file = fopen( w.filename.c_str() , w.created ? "a" : "w" );
+	if ( w.file )
+	{
+		w.created = true;
+		openWriters.push_front( &w );
+		w.recent = openWriters.begin();
+	}
+	else //Error opening file
+		std::cout << "PINDEL2SAM_ERROR: could not open " << w.filename << std::endl;
+	pthread_mutex_unlock( &fileLock );
+
+	return w.file != NULL;
+}
+
+void release_writer( struct sam_writer& w )
+{
+	if ( !w.file )
+		return;
+	if ( fclose( w.file ) != 0 )
+		std::cout << "PINDEL2SAM_ERROR: Could not write to " << w.filename << std::endl;
+	w.file = NULL;
+	openWriters.erase( w.recent );
+}
+
+void close_writers( const struct header& h )
+{
+	struct finalize_queue fq;
+	std::vector<pthread_t> finishers( std::min( (size_t)std::min( finalizeThreads , maxOpenOutputs ) , outputWriters.size() ) ); //each needs an open file
+
+	fq.h = &h;
+	fq.next = 0;
+	fq.memoryUsed = 0;
+	fq.running = 0;
+	for ( unsigned i = 0; i < outputWriters.size(); i++ )
+		fq.outputs.push_back( std::make_pair( finalize_memory( outputWriters[i] ) , i ) );
+	std::sort( fq.outputs.begin() , fq.outputs.end() , larger_output ); //the longest jobs start first
+
+	for ( unsigned t = 0; t < finishers.size(); t++ )
+		pthread_create( &finishers[t] , NULL , finalize_outputs , &fq );
+	for ( unsigned t = 0; t < finishers.size(); t++ )
+		pthread_join( finishers[t] , NULL );
+
+	if ( shardOutput )
+	{
+		std::string filename = outputDirectoryName+SHARDMANIFESTNAME;
+		std::ofstream manifest( filename.c_str() );
+		for ( unsigned i = 0; i < outputWriters.size(); i++ ) //in output order, however the threads finished
+			manifest << outputWriters[i].shardLines;
+		manifest.close();
+		if ( !manifest )
+			std::cout << "PINDEL2SAM_ERROR: Could not write to " << filename << std::endl;
+	}
+}
+
+void* finalize_outputs( void* arg )
+{
+	struct finalize_queue& fq = *(struct finalize_queue*)arg;
+	size_t need;
+	unsigned i;
+
+	pthread_mutex_lock( &finalizeLock );
+	while ( true )
+	{
+		if ( fq.next >= fq.outputs.size() )
+			break;
+		need = fq.outputs[fq.next].first;
+		if ( fq.running > 0 && sortMemoryUsed+fq.memoryUsed+need > sortMemory ) //wait for memory, one output always runs
+		{
+			pthread_cond_wait( &finalizeRoom , &finalizeLock );
+			continue;
+		}
+		i = fq.outputs[fq.next++].second;
+		fq.memoryUsed += need;
+		fq.running++;
+		pthread_mutex_unlock( &finalizeLock );
+
+		pthread_mutex_lock( &fileLock );
+		outputWriters[i].busy = true;
+		pthread_mutex_unlock( &fileLock );
+		finalize_writer( outputWriters[i] , *fq.h );
+
+		pthread_mutex_lock( &finalizeLock );
+		fq.memoryUsed -= need;
+		fq.running--;
+		pthread_cond_broadcast( &finalizeRoom );
+	}
+	pthread_mutex_unlock( &finalizeLock );
+
+	return NULL;
+}
+
+void finalize_writer( struct sam_writer& w , const struct header& h )
+{
+	if ( sortOutput )
+		merge_runs( w , h );
+	if ( shardOutput )
+	{
+		finish_shard( w , h );
+		return;
+	}
+	flush_writer( w , true );
+	if ( w.indexed )
+		save_index( w );
+	pthread_mutex_lock( &fileLock );
+	release_writer( w );
+	pthread_mutex_unlock( &fileLock );
+}
+
+size_t finalize_memory( const struct sam_writer& w )
+{
+	size_t bytes = OUTPUTBUFFERSIZE+JOBSPERTHREAD*BGZFBLOCKSIZE; //output buffer and blocks waiting to be written
+	if ( w.runs.empty() )
+		bytes += w.entries.size()*sizeof( struct sort_entry ); //stable_sort's buffer
+	else
+		bytes += ( w.runs.size()+1 )*BUFSIZ; //a read buffer per run, the records left in memory are spilled first
+	return bytes;
+}
+
+bool larger_output( const std::pair<size_t,unsigned>& a , const std::pair<size_t,unsigned>& b )
+{
+	return a.first > b.first || ( a.first == b.first && a.second < b.second );
+}
+
+void write_files( struct pindel_fields& pid , const struct header& h , std::vector<struct record_batch>& batches , std::ostream& log )
+{
+	struct sam_event ev;
+	struct sam_fields sam;
+
+	event_conversion( pid , h , ev );
+	for ( unsigned supportIndex = 0; supportIndex < pid.supportsRead; supportIndex++ ) //one pass, the output was found in set_support
+	{
+		int output = pid.supports[supportIndex].output;
+		field_conversion( pid , supportIndex , ev , sam );
+		if ( sam.CIGARops > 0 )
+			save_sam( ev , sam , outputWriters[output].bgzf , batches[output] , log );
+		else
+			log << "PINDEL2SAM_ERROR: no CIGAR for read " << std::string( sam.QNAME.ptr , sam.QNAME.len ) << " of the " << pid.indelType << " event at " << h.chrOrder[pid.refID] << ":" << pid.BPLeft_plus_one << std::endl;
+	}//for each support
+}
+
+void convert_events( struct pindel_reader& file , const struct header& h , std::map<std::string,std::string>& sm , std::map<std::string,int>& om , std::vector<struct record_batch>& batches , bool direct )
+{
+	struct pindel_fields PIN;
+	struct text_span line;
+	int leftRefLength, value;
+
+	while ( next_line( file , line ) )
+	{
+		skip_tokens( line , 0 );
+		if ( line.len == 0 ) //blank line
+		{
+			file.linenum++;
+			continue;
+		}
+		leftRefLength = 0;
+
+		if ( direct )
+			print_update( file.linebase+file.linenum , file.nextprint );
+
+		// SUMMARY SEPARATION LINE
+		if ( check_separation( file , line ) != 0 ) //check # count
+		{
+			skip_to_separation( file );
+			continue;
+		}
+
+		// SUMMARY DATA LINE
+		if ( !next_line( file , line ) )
+			break;
+		value = set_pindel_fields( file , line , h , PIN ); //set summary data
+
+		if ( value == 0 && !regions.empty() && !in_regions( PIN.refID , PIN.BPLeft_plus_one ) )
+			skip_to_separation( file );
+		else if ( value == 0 ) //no errors from summary section
+		{
+			// REFERENCE LINE
+			leftRefLength = set_reference_detail( file , PIN );
+
+			// READ SUPPORTS
+			set_supports( file , PIN , sm , om , leftRefLength );
+
+			// WRITE TO FILE
+			write_files( PIN , h , batches , *file.log );
+			if ( direct )
+			{
+				commit_batches( batches );
+				if ( !checkpointFilename.empty() && !file.gz ) //gzip inputs are checkpointed when finished
+					checkpoint_input( file , file.cur-file.data , false );
+			}
+		}
+		else
+		{//Error in summary	
+			*file.log << "PINDEL2SAM_ERROR: bad summary on line = " << line_number( file ) << std::endl;
+			skip_to_separation( file );
+		}//if reading supports
+	}//while reading file
+	arena_free( PIN.arena );
+}
+
+bool larger_file( const std::pair<off_t,std::string>& a , const std::pair<off_t,std::string>& b )
+{
+	if ( a.first != b.first )
+		return a.first > b.first;
+	return a.second < b.second;
+}
+
+void convert_files( std::vector<struct pindel_reader>& files , const struct header& h , std::map<std::string,std::string>& sm , std::map<std::string,int>& om )
+{
+	struct chunk_queue cq;
+	struct pindel_chunk chunk;
+	std::vector<pthread_t> parsers( parseThreads );
+	std::vector<struct record_batch> batches( outputWriters.size() );
+	std::vector<struct event_group> ranges;
+	size_t text;
+	int lines, nextprint;
+	unsigned c = 0;
+
+	cq.h = &h;
+	cq.sm = &sm;
+	cq.om = &om;
+	cq.next = cq.written = 0;
+	chunk.linesRead = 0;
+	chunk.done = chunk.counted = false;
+	chunk.block = chunk.blockEnd = 0;
+	for ( unsigned f = 0; f < files.size(); f++ ) //one queue, threads done with small files take pieces of larger ones
+	{
+		if ( check_fragment( files[f].fragment ) ) //replayed in order below
+			continue;
+		chunk.file = &files[f];
+		chunk.lines = 0; //the first piece of each file
+		if ( files[f].gz ) //BGZF is cut into pieces of whole blocks, each parse thread inflates its own
+		{
+			const std::vector<size_t>& blocks = files[f].gz->blocks;
+			chunk.begin = chunk.end = NULL;
+			index_bgzf( files[f] ); //other gzip files get no pieces
+			for ( unsigned b = 0; b+1 < blocks.size(); b = chunk.blockEnd )
+			{
+				chunk.block = b;
+				for ( text = 0; b+1 < blocks.size() && text < CHUNKSIZE; b++ ) //ISIZE ends each block
+					text += get_int32( files[f].data+blocks[b+1]-4 );
+				chunk.blockEnd = b;
+				cq.chunks.push_back( chunk );
+			}
+			continue;
+		}
+		select_events( files[f] , ranges );
+		for ( unsigned r = 0; r < ranges.size(); r++ )
+		{
+			const char* end = files[f].data+ranges[r].end;
+			chunk.lines = ranges[r].lines;
+			for ( const char* p = files[f].data+ranges[r].begin; p < end; p = chunk.end ) //pieces start at # lines so each holds whole events
+			{
+				chunk.begin = p;
+				chunk.end = find_separation( p+std::min( CHUNKSIZE , (size_t)( end-p ) ) , p , end );
+				cq.chunks.push_back( chunk );
+				chunk.lines = -1;
+			}
+		}
+	}
+
+	for ( int t = 0; t < parseThreads; t++ )
+		pthread_create( &parsers[t] , NULL , convert_chunks , &cq );
+	for ( unsigned f = 0; f < files.size(); f++ ) //write in queue order
+	{
+		std::cout << "\t\tOpened: " << files[f].filename << std::endl;
+		lines = 0;
+		nextprint = UPDATEFREQUENCY;
+		if ( ( c == cq.chunks.size() || cq.chunks[c].file != &files[f] ) && replay_fragment( files[f] , batches ) ) //unchanged, no pieces were queued
+			;
+		else
+		{
+			begin_fragment( files[f] );
+			if ( files[f].gz && files[f].gz->blocks.empty() ) //gzip that is not BGZF can only be read from the start
+				convert_compressed( files[f] , h , sm , om , batches );
+			else if ( c < cq.chunks.size() && cq.chunks[c].file == &files[f] ) //not empty
+				print_update( lines , nextprint );
+		}
+		for ( ; c < cq.chunks.size() && cq.chunks[c].file == &files[f]; c++ )
+		{
+			struct pindel_chunk& pc = cq.chunks[c];
+			pthread_mutex_lock( &chunkLock );
+			while ( !pc.done )
+				pthread_cond_wait( &chunkDone , &chunkLock );
+			pthread_mutex_unlock( &chunkLock );
+
+			std::cout << pc.log;
+			commit_batches( pc.batches );
+			if ( !checkpointFilename.empty() && !files[f].gz )
+				checkpoint_input( files[f] , pc.end-files[f].data , false );
+			std::vector<struct record_batch>().swap( pc.batches );
+			std::string().swap( pc.log );
+			lines += pc.linesRead;
+			print_update( lines , nextprint );
+
+			pthread_mutex_lock( &chunkLock );
+			cq.written++;
+			pthread_cond_broadcast( &chunkRoom );
+			pthread_mutex_unlock( &chunkLock );
+		}
+		end_fragment();
+		if ( !checkpointFilename.empty() )
+			checkpoint_input( files[f] , files[f].size , true );
+		close_reader( files[f] );
+		std::cout << "\t\t\t\tClosed: " << files[f].filename << std::endl;
+	}
+	for ( int t = 0; t < parseThreads; t++ )
+		pthread_join( parsers[t] , NULL );
+}
+
+void prefetch_chunk( const struct pindel_chunk& pc )
+{
+	const char* begin = pc.begin;
+	const char* end = pc.end;
+	uintptr_t page = sysconf( _SC_PAGESIZE ), first;
+
+	if ( pc.file->gz ) //the compressed blocks of the piece
+	{
+		begin = pc.file->data+pc.file->gz->blocks[pc.block];
+		end = pc.file->data+pc.file->gz->blocks[pc.blockEnd];
+	}
+	if ( !begin || end <= begin )
+		return;
+	first = (uintptr_t)begin & ~( page-1 ); //madvise needs a page boundary
+	madvise( (void*)first , (uintptr_t)end-first , MADV_WILLNEED );
+}
+
+void* convert_chunks( void* arg )
+{
+	struct chunk_queue& cq = *(struct chunk_queue*)arg;
+	struct pindel_reader piece;
+	std::ostringstream log;
+	unsigned c;
+
+	pthread_mutex_lock( &chunkLock );
+	while ( true )
+	{
+		while ( cq.next < cq.chunks.size() && cq.next >= cq.written+CHUNKSPERTHREAD*parseThreads ) //bounds memory held for writing
+			pthread_cond_wait( &chunkRoom , &chunkLock );
+		if ( cq.next >= cq.chunks.size() )
+			break;
+		c = cq.next++;
+		pthread_mutex_unlock( &chunkLock );
+		if ( c+1 < cq.chunks.size() ) //read ahead while this piece is converted
+			prefetch_chunk( cq.chunks[c+1] );
+
+		struct pindel_chunk& pc = cq.chunks[c];
+		if ( pc.file->gz )
+			inflate_piece( cq , c );
+		piece = *pc.file;
+		piece.cur = piece.data = pc.begin;
+		piece.end = pc.end;
+		piece.linenum = 0;
+		piece.linebase = -1;
+		piece.log = &log;
+		piece.chunks = &cq;
+		piece.chunk = c;
+		log.str( "" );
+		pc.batches.resize( outputWriters.size() );
+		convert_events( piece , *cq.h , *cq.sm , *cq.om , pc.batches , false );
+
+		pthread_mutex_lock( &chunkLock );
+		pc.log += log.str();
+		std::string().swap( pc.text );
+		pc.linesRead = piece.linenum;
+		pc.done = true;
+		pthread_cond_broadcast( &chunkDone );
+	}
+	pthread_mutex_unlock( &chunkLock );
+
+	return NULL;
+}
+
+int chunk_line_base( struct chunk_queue& cq , unsigned c )
+{
+	unsigned known = c;
+	int lines;
+
+	pthread_mutex_lock( &chunkLock );
+	if ( cq.chunks[c].file->gz ) //lines of each BGZF piece are counted as it is inflated
+	{
+		lines = cq.chunks[c].headLines;
+		for ( known = c; known > 0 && cq.chunks[known-1].file == cq.chunks[c].file; known-- )
+		{
+			while ( !cq.chunks[known-1].counted ) //taken earlier, so already inflating
+				pthread_cond_wait( &chunkDone , &chunkLock );
+			lines += cq.chunks[known-1].blockLines;
+		}
+		pthread_mutex_unlock( &chunkLock );
+
+		return lines;
+	}
+	while ( cq.chunks[known].lines < 0 ) //the first piece of each file and region range is always known
+		known--;
+	for ( ; known < c; known++ )
+		cq.chunks[known+1].lines = cq.chunks[known].lines+std::count( cq.chunks[known].begin , cq.chunks[known].end , '\n' );
+	lines = cq.chunks[c].lines;
+	pthread_mutex_unlock( &chunkLock );
+
+	return lines;
+}
+
+/* REGIONS */
+bool parse_region( const std::string& region , std::string& chr , int& start , int& end )
+{
+	std::string::size_type colon = region.rfind( ':' );
+	std::string span;
+
+	chr = region;
+	start = 1;
+	end = 0x7fffffff;
+	if ( colon != std::string::npos && colon+1 < region.length() && isdigit( region[colon+1] ) ) //chrID may itself hold a colon
+	{
+		chr = region.substr( 0 , colon );
+		for ( unsigned c = colon+1; c < region.length(); c++ )
+		{
+			if ( region[c] != ',' ) //1,000,000
+				span += region[c];
+		}
+		std::string::size_type dash = span.find( '-' );
+		start = str2int( span.substr( 0 , dash ) );
+		if ( dash != std::string::npos )
+			end = str2int( span.substr( dash+1 ) );
+	}
+	return !chr.empty() && start >= 1 && end >= start;
+}
+
+int add_region( const std::string& region )
+{
+	std::string chr;
+	int start, end;
+
+	if ( !parse_region( region , chr , start , end ) )
+	{
+		std::cout << "PINDEL2SAM_ERROR: bad region " << region << " (use chr, chr:start or chr:start-end)" << std::endl;
+		return 1;
+	}
+	regions[chr].push_back( std::make_pair( start , end ) );
+
+	return 0;
+}
+
+int read_bed_file( const std::string& filename )
+{
+	std::ifstream file( filename.c_str() );
+	std::string row, chr;
+	int start, end;
+
+	if ( !file.good() )
+	{
+		std::cout << "PINDEL2SAM_ERROR: could not open " << filename << std::endl;
+		return 1;
+	}
+	while ( std::getline( file , row ) )
+	{
+		std::istringstream fields( row );
+		if ( row.empty() || row[0] == '#' || row.compare( 0 , 5 , "track" ) == 0 || row.compare( 0 , 7 , "browser" ) == 0 )
+			continue;
+		if ( !( fields >> chr >> start >> end ) || start < 0 || end <= start )
+		{
+			std::cout << "PINDEL2SAM_ERROR: bad BED line in " << filename << ": " << row << std::endl;
+			return 1;
+		}
+		regions[chr].push_back( std::make_pair( start+1 , end ) ); //BED is 0-based, half open
+	}
+
+	return 0;
+}
+
+void merge_regions()
+{
+	for ( std::map< std::string , std::vector< std::pair<int,int> > >::iterator rit = regions.begin(); rit != regions.end(); ++rit )
+	{
+		std::vector< std::pair<int,int> >& spans = rit->second;
+		unsigned kept = 0;
+		std::sort( spans.begin() , spans.end() );
+		for ( unsigned s = 1; s < spans.size(); s++ )
+		{
+			if ( spans[s].first <= spans[kept].second )
+				spans[kept].second = std::max( spans[kept].second , spans[s].second );
+			else
+				spans[++kept] = spans[s];
+		}
+		spans.resize( std::min( (size_t)kept+1 , spans.size() ) );
+	}
+}
+
+void resolve_regions( const struct header& h )
+{
+	int refID;
+
+	refRegions.assign( h.chrOrder.size() , std::vector< std::pair<int,int> >() );
+	for ( std::map< std::string , std::vector< std::pair<int,int> > >::iterator rit = regions.begin(); rit != regions.end(); ++rit )
+	{
+		if ( ( refID = find_reference( h , rit->first.data() , rit->first.length() ) ) < 0 )
+			std::cout << "PINDEL2SAM_WARNING: region on " << rit->first << ", which is not in the reference index" << std::endl;
+		else
+			refRegions[refID] = rit->second;
+	}
+}
+
+bool in_regions( int refID , int bp )
+{
+	const std::vector< std::pair<int,int> >& spans = refRegions[refID];
+	std::vector< std::pair<int,int> >::const_iterator sit = std::upper_bound( spans.begin() , spans.end() , std::make_pair( bp , 0x7fffffff ) );
+
+	return sit != spans.begin() && (--sit)->second >= bp;
+}
+
+void build_event_index( const struct pindel_reader& file , struct event_index& index )
+{
+	struct pindel_reader scan = file;
+	struct text_span line, chr, bp;
+	struct event_group group;
+	std::map<std::string,int> chrs;
+	std::map<std::string,int>::iterator cit;
+	const char* start;
+	int lines = 0, position;
+	struct stat st;
+
+	index.size = file.size;
+	index.mtime = ( stat( file.filename.c_str() , &st ) == 0 ) ? st.st_mtime : 0;
+	index.chrs.clear();
+	index.groups.clear();
+	scan.cur = scan.data;
+	while ( scan.cur < scan.end )
+	{
+		start = scan.cur;
+		next_line( scan , line );
+		lines++;
+		if ( line.len == 0 || line.ptr[0] != '#' || !next_line( scan , line ) )
+			continue;
+		lines++;
+		skip_tokens( line , 7 ); //SVIndex type size NT NT_size NT_seq ChrID
+		next_token( line , chr );
+		skip_tokens( line , 1 ); //BP
+		next_token( line , bp );
+		position = span2int( bp );
+		cit = chrs.insert( std::make_pair( std::string( chr.ptr , chr.len ) , (int)chrs.size() ) ).first;
+		if ( cit->second == (int)index.chrs.size() )
+			index.chrs.push_back( cit->first );
+		if ( index.groups.empty() || index.groups.back().chr != cit->second ||
+		     start-file.data-index.groups.back().begin >= INDEXGROUPSIZE ) //new group
+		{
+			group.chr = cit->second;
+			group.minBP = group.maxBP = position;
+			group.begin = start-file.data;
+			group.lines = lines-2;
+			if ( !index.groups.empty() )
+				index.groups.back().end = group.begin;
+			index.groups.push_back( group );
+		}
+		else
+		{
+			index.groups.back().minBP = std::min( index.groups.back().minBP , position );
+			index.groups.back().maxBP = std::max( index.groups.back().maxBP , position );
+		}
+	}
+	if ( !index.groups.empty() )
+		index.groups.back().end = file.size;
+}
+
+bool load_event_index( const struct pindel_reader& file , struct event_index& index )
+{
+	return read_event_index( file , event_index_name( file , true ) , index ) || read_event_index( file , event_index_name( file , false ) , index );
+}
+
+bool read_event_index( const struct pindel_reader& file , const std::string& filename , struct event_index& index )
+{
+	std::string in;
+	FILE* sidecar = fopen( filename.c_str() , "rb" );
+	char buffer[65536];
+	size_t got, at = 24;
+	struct stat st;
+
+	if ( !sidecar )
+		return false;
+	while ( ( got = fread( buffer , 1 , sizeof( buffer ) , sidecar ) ) > 0 )
+		in.append( buffer , got );
+	fclose( sidecar );
+	if ( in.length() < 32 || in.compare( 0 , 4 , "P2SI" ) != 0 || get_int32( in.data()+4 ) != 1 )
+		return false;
+	index.size = (uint32_t)get_int32( in.data()+8 ) | (uint64_t)(uint32_t)get_int32( in.data()+12 ) << 32;
+	index.mtime = (uint32_t)get_int32( in.data()+16 ) | (int64_t)get_int32( in.data()+20 ) << 32;
+	if ( stat( file.filename.c_str() , &st ) != 0 || index.size != file.size || index.mtime != st.st_mtime ) //the file changed
+		return false;
+	index.chrs.resize( (uint32_t)get_int32( in.data()+at ) );
+	at += 4;
+	for ( unsigned c = 0; c < index.chrs.size(); c++ )
+	{
+		uint32_t length = get_int32( in.data()+at );
+		if ( in.length() < at+4+length+4 )
+			return false;
+		index.chrs[c].assign( in.data()+at+4 , length );
+		at += 4+length;
+	}
+	index.groups.resize( (uint32_t)get_int32( in.data()+at ) );
+	at += 4;
+	if ( in.length() != at+24*index.groups.size() )
+		return false;
+	for ( unsigned g = 0; g < index.groups.size(); g++ , at += 24 )
+	{
+		struct event_group& group = index.groups[g];
+		group.chr = get_int32( in.data()+at );
+		group.minBP = get_int32( in.data()+at+4 );
+		group.maxBP = get_int32( in.data()+at+8 );
+		group.begin = (uint32_t)get_int32( in.data()+at+12 ) | (uint64_t)(uint32_t)get_int32( in.data()+at+16 ) << 32;
+		group.lines = get_int32( in.data()+at+20 );
+		if ( g > 0 )
+			index.groups[g-1].end = group.begin;
+		if ( group.chr < 0 || group.chr >= (int)index.chrs.size() || group.begin > index.size )
+			return false;
+	}
+	if ( !index.groups.empty() )
+		index.groups.back().end = index.size;
+
+	return true;
+}
+
+void save_event_index( const struct pindel_reader& file , const struct event_index& index )
+{
+	std::string filename = event_index_name( file , true ), out = "P2SI";
+
+	put_int32( out , 1 ); //version
+	put_uint32( out , (uint32_t)index.size );
+	put_uint32( out , (uint32_t)( index.size >> 32 ) );
+	put_uint32( out , (uint32_t)index.mtime );
+	put_uint32( out , (uint32_t)( (uint64_t)index.mtime >> 32 ) );
+	put_int32( out , index.chrs.size() );
+	for ( unsigned c = 0; c < index.chrs.size(); c++ )
+	{
+		put_int32( out , index.chrs[c].length() );
+		out += index.chrs[c];
+	}
+	put_int32( out , index.groups.size() );
+	for ( unsigned g = 0; g < index.groups.size(); g++ ) //the end of each group is the begin of the next
+	{
+		put_int32( out , index.groups[g].chr );
+		put_int32( out , index.groups[g].minBP );
+		put_int32( out , index.groups[g].maxBP );
+		put_uint32( out , (uint32_t)index.groups[g].begin );
+		put_uint32( out , (uint32_t)( index.groups[g].begin >> 32 ) );
+		put_int32( out , index.groups[g].lines );
+	}
+	FILE* sidecar = fopen( filename.c_str() , "wb" );
+	if ( !sidecar ) //the Pindel directory may be read only or shared
+	{
+		filename = event_index_name( file , false );
+		sidecar = fopen( filename.c_str() , "wb" );
+		if ( sidecar )
+			std::cout << "\t\tCould not write next to " << file.filename << ", event index written to " << filename << std::endl;
+	}
+	if ( !sidecar || fwrite( out.data() , 1 , out.length() , sidecar ) != out.length() )
+		std::cout << "PINDEL2SAM_WARNING: Could not write to " << filename << std::endl;
+	if ( sidecar )
+		fclose( sidecar );
+}
+
+std::string event_index_name( const struct pindel_reader& file , bool beside )
+{
+	std::string directory = cacheDirectory.empty() ? outputDirectoryName : cacheDirectory;
+
+	if ( beside )
+		return file.filename+EVENTINDEXSUFFIX;
+	if ( !directory.empty() && directory[directory.length()-1] != '/' )
+		directory += "/";
+	return directory+file.filename.substr( file.filename.rfind( '/' )+1 )+EVENTINDEXSUFFIX;
+}
+
+void select_events( struct pindel_reader& file , std::vector<struct event_group>& ranges )
+{
+	struct event_index index;
+	struct event_group whole;
+	std::map< std::string , std::pair<uint64_t,uint64_t> >::const_iterator cit = checkpointInputs.find( file.filename );
+	uint64_t done = ( cit == checkpointInputs.end() ) ? 0 : cit->second.first;
+	unsigned kept = 0;
+
+	ranges.clear();
+	if ( regions.empty() )
+	{
+		whole.begin = 0;
+		whole.end = file.size;
+		whole.lines = 0;
+		ranges.push_back( whole );
+	}
+	else if ( !load_event_index( file , index ) ) //made once, later runs seek straight to the regions
+	{
+		build_event_index( file , index );
+		save_event_index( file , index );
+	}
+	for ( unsigned g = 0; g < index.groups.size(); g++ )
+	{
+		const struct event_group& group = index.groups[g];
+		std::map< std::string , std::vector< std::pair<int,int> > >::const_iterator rit = regions.find( index.chrs[group.chr] );
+		if ( rit == regions.end() )
+			continue;
+		std::vector< std::pair<int,int> >::const_iterator sit = std::upper_bound( rit->second.begin() , rit->second.end() , std::make_pair( group.maxBP , 0x7fffffff ) );
+		if ( sit == rit->second.begin() || (--sit)->second < group.minBP ) //no region overlaps [minBP,maxBP]
+			continue;
+		if ( !ranges.empty() && ranges.back().end == group.begin ) //read neighbouring groups together
+			ranges.back().end = group.end;
+		else
+			ranges.push_back( group );
+	}
+	for ( unsigned r = 0; r < ranges.size() && done > 0; r++ ) //skip what a checkpointed run already converted
+	{
+		if ( ranges[r].end <= done )
+			continue;
+		if ( ranges[r].begin < done )
+		{
+			ranges[r].begin = done;
+			ranges[r].lines = std::count( file.data , file.data+done , '\n' );
+		}
+		ranges[kept++] = ranges[r];
+	}
+	if ( done > 0 )
+		ranges.resize( kept );
+}
+
+/* REGION SERVER */
+int serve_regions( const std::vector< std::pair<off_t,std::string> >& pindelFiles , const struct header& h , std::map<std::string,std::string>& sm , std::map<std::string,int>& om )
+{
+	struct region_server rs;
+	struct served_file sf;
+	struct sockaddr_un address;
+	std::string request, reply;
+	char buffer[SERVEREQUESTSIZE];
+	ssize_t got;
+	size_t sent;
+	int listener, client;
+
+	rs.h = &h;
+	rs.sm = &sm;
+	rs.om = &om;
+	rs.cacheUsed = 0;
+	outputFormat = "bam"; //served records are encoded as BAM and sorted by save_sam
+	sortOutput = true;
+	outputWriters.resize( NUMBEROFSAMPLES );
+	for ( unsigned o = 0; o < outputWriters.size(); o++ )
+		outputWriters[o].bgzf = true;
+	for ( unsigned f = 0; f < pindelFiles.size(); f++ ) //files stay mapped while serving
+	{
+		if ( !open_reader( sf.reader , pindelFiles[f].second ) )
+			std::cout << "PINDEL2SAM_ERROR: could not open " << pindelFiles[f].second << std::endl;
+		else if ( sf.reader.gz )
+		{
+			std::cout << "PINDEL2SAM_WARNING: cannot serve compressed " << sf.reader.filename << ", it is not indexed" << std::endl;
+			close_reader( sf.reader );
+		}
+		else
+		{
+			if ( !load_event_index( sf.reader , sf.index ) )
+			{
+				build_event_index( sf.reader , sf.index );
+				save_event_index( sf.reader , sf.index );
+			}
+			rs.files.push_back( sf );
+			std::cout << "\t\tServing: " << sf.reader.filename << std::endl;
+		}
+	}
+
+	signal( SIGPIPE , SIG_IGN ); //a client leaving early must not end the server
+	memset( &address , 0 , sizeof( address ) );
+	address.sun_family = AF_UNIX;
+	if ( servePath.length() >= sizeof( address.sun_path ) )
+	{
+		std::cout << "PINDEL2SAM_ERROR: socket path too long: " << servePath << std::endl;
+		return 1;
+	}
+	strcpy( address.sun_path , servePath.c_str() );
+	unlink( servePath.c_str() ); //left over from an earlier server
+	listener = socket( AF_UNIX , SOCK_STREAM , 0 );
+	if ( listener < 0 || bind( listener , (struct sockaddr*)&address , sizeof( address ) ) != 0 || listen( listener , 16 ) != 0 )
+	{
+		std::cout << "PINDEL2SAM_ERROR: could not listen on " << servePath << std::endl;
+		return 1;
+	}
+	std::cout << "\t\tListening: " << servePath << std::endl;
+	while ( ( client = accept( listener , NULL , NULL ) ) >= 0 || errno == EINTR ) //one request per connection
+	{
+		if ( client < 0 )
+			continue;
+		request.clear();
+		while ( request.find( '\n' ) == std::string::npos && request.length() < SERVEREQUESTSIZE &&
+		        ( got = read( client , buffer , sizeof( buffer ) ) ) > 0 )
+			request.append( buffer , got );
+		request = request.substr( 0 , request.find( '\n' ) );
+		if ( !request.empty() && request[request.length()-1] == '\r' )
+			request.erase( request.length()-1 );
+		if ( request == "quit" )
+		{
+			close( client );
+			break;
+		}
+		reply = serve_request( rs , request );
+		for ( sent = 0; sent < reply.length() && ( got = write( client , reply.data()+sent , reply.length()-sent ) ) > 0; sent += got );
+		close( client );
+	}
+	close( listener );
+	unlink( servePath.c_str() );
+	for ( unsigned f = 0; f < rs.files.size(); f++ )
+		close_reader( rs.files[f].reader );
+
+	return 0;
+}
+
+std::vector<struct record_batch>& served_group( struct region_server& rs , unsigned f , unsigned g )
+{
+	std::pair<unsigned,unsigned> key( f , g );
+	std::map< std::pair<unsigned,unsigned> , std::list<struct served_entry>::iterator >::iterator cit = rs.cached.find( key );
+	const struct event_group& group = rs.files[f].index.groups[g];
+	struct pindel_reader piece = rs.files[f].reader;
+	struct served_entry entry;
+
+	if ( cit != rs.cached.end() ) //move to the front
+	{
+		rs.cache.splice( rs.cache.begin() , rs.cache , cit->second );
+		return rs.cache.front().batches;
+	}
+	entry.key = key;
+	entry.batches.resize( outputWriters.size() );
+	piece.data = piece.cur = rs.files[f].reader.data+group.begin;
+	piece.end = rs.files[f].reader.data+group.end;
+	piece.linebase = group.lines;
+	piece.linenum = 0;
+	convert_events( piece , *rs.h , *rs.sm , *rs.om , entry.batches , false );
+	entry.bytes = sizeof( struct served_entry );
+	for ( unsigned o = 0; o < entry.batches.size(); o++ )
+		entry.bytes += entry.batches[o].data.capacity()+entry.batches[o].entries.capacity()*sizeof( struct sort_entry );
+	while ( !rs.cache.empty() && rs.cacheUsed+entry.bytes > cacheMemory ) //drop the least recently used
+	{
+		rs.cacheUsed -= rs.cache.back().bytes;
+		rs.cached.erase( rs.cache.back().key );
+		rs.cache.pop_back();
+	}
+	rs.cache.push_front( entry );
+	rs.cached[key] = rs.cache.begin();
+	rs.cacheUsed += entry.bytes;
+
+	return rs.cache.front().batches;
+}
+
+std::string serve_request( struct region_server& rs , const std::string& request )
+{
+	std::istringstream fields( request );
+	std::string name, region, chr, records, bam, reply;
+	std::vector<struct sort_entry> entries; //offsets into records
+	std::map<std::string,int>::iterator oit;
+	std::map<std::string,std::string>::iterator sit;
+	struct header oh = *rs.h;
+	struct sort_entry entry;
+	int start, end, output, chrRef, refID, beg, stop;
+
+	if ( !( fields >> name >> region ) || !parse_region( region , chr , start , end ) )
+		return "PINDEL2SAM_ERROR: bad request " + request + " (use <sample or output> chr:start-end)\n";
+	oit = rs.om->find( name );
+	if ( oit == rs.om->end() && ( sit = rs.sm->find( name ) ) != rs.sm->end() )
+		oit = rs.om->find( sit->second );
+	if ( oit == rs.om->end() )
+		return "PINDEL2SAM_ERROR: unknown sample " + name + "\n";
+	output = oit->second;
+	chrRef = find_reference( *rs.h , chr.data() , chr.length() );
+	if ( chrRef < 0 )
+		return "PINDEL2SAM_ERROR: unknown chromosome " + chr + " (not in the reference index)\n";
+
+	for ( unsigned f = 0; f < rs.files.size(); f++ )
+	{
+		const struct event_index& index = rs.files[f].index;
+		for ( unsigned g = 0; g < index.groups.size(); g++ )
+		{
+			if ( index.chrs[index.groups[g].chr] != chr || index.groups[g].maxBP < start-SERVEMARGIN || index.groups[g].minBP > end )
+				continue;
+			struct record_batch& batch = served_group( rs , f , g )[output];
+			for ( unsigned e = 0; e < batch.entries.size(); e++ ) //reads overlapping the region
+			{
+				bam_span( batch.data.data()+batch.entries[e].offset , refID , beg , stop );
+				if ( refID != chrRef || stop < start || beg >= end )
+					continue;
+				entry = batch.entries[e];
+				entry.offset = records.length();
+				records.append( batch.data , batch.entries[e].offset , entry.length ); //copied, the group may be evicted by the next one
+				entries.push_back( entry );
+			}
+		}
+	}
+	std::stable_sort( entries.begin() , entries.end() );
+	oh.top = "@HD\tVN:"+SAMVERSION+"\tSO:coordinate\n";
+	bam_header( oh , bam );
+	for ( unsigned e = 0; e < entries.size(); e++ )
+		bam.append( records , entries[e].offset , entries[e].length );
+	for ( size_t done = 0; done < bam.length(); done += BGZFBLOCKSIZE )
+		bgzf_block( bam.data()+done , std::min( BGZFBLOCKSIZE , bam.length()-done ) , reply , compressionLevel );
+	bgzf_block( NULL , 0 , reply , compressionLevel ); //EOF block
+
+	return reply;
+}
+
+/* CHECKPOINTS */
+int load_checkpoint()
+{
+	std::ifstream manifest( checkpointFilename.c_str() );
+	std::string kind, path, options = checkpoint_options();
+	uint64_t bytes, size = 0;
+	struct stat st;
+
+	if ( !manifest.good() ) //a fresh run
+		return 0;
+	if ( !std::getline( manifest , path ) || path != options )
+	{
+		std::cout << "PINDEL2SAM_ERROR: " << checkpointFilename << " is from a run with other options (" << path << "), not " << options << ", run with those or remove it and the outputs" << std::endl;
+		return 1;
+	}
+	while ( manifest >> kind >> bytes && ( kind != "input" || manifest >> size ) )
+	{
+		manifest.get(); //tab before the path, which may hold spaces
+		std::getline( manifest , path );
+		if ( kind == "output" )
+		{
+			if ( stat( path.c_str() , &st ) != 0 || (uint64_t)st.st_size < bytes || truncate( path.c_str() , bytes ) != 0 )
+			{
+				std::cout << "PINDEL2SAM_ERROR: could not cut " << path << " back to its checkpoint" << std::endl;
+				return 1;
+			}
+		}
+		else if ( stat( path.c_str() , &st ) != 0 || (uint64_t)st.st_size != size )
+		{
+			std::cout << "PINDEL2SAM_ERROR: " << path << " changed since " << checkpointFilename << " was written" << std::endl;
+			return 1;
 		}
-		else 
-		{//Error from set_suport skip to end of supports
-			std::getline( file , line ); //could try another method of finding the next good line
-			linenum++;
-			supportIndex++;
+		else
+			checkpointInputs[path] = std::make_pair( bytes , size );
+	}
+	resuming = true;
+	std::cout << "\t\tResuming from checkpoint: " << checkpointFilename << std::endl;
+
+	return 0;
+}
+
+std::string checkpoint_options()
+{
+	std::ostringstream options;
+
+	options << "options --format " << outputFormat;
+	if ( !mergedOutput.empty() )
+		options << " --merge " << mergedOutput;
+	for ( std::map< std::string , std::vector< std::pair<int,int> > >::iterator rit = regions.begin(); rit != regions.end(); ++rit )
+		for ( unsigned r = 0; r < rit->second.size(); r++ ) //merged, so the same regions give the same line however they were given
+			options << " --region " << rit->first << ':' << rit->second[r].first << '-' << rit->second[r].second;
+
+	return options.str();
+}
+
+void checkpoint_input( const struct pindel_reader& file , uint64_t done , bool now )
+{
+	std::pair<uint64_t,uint64_t>& input = checkpointInputs[file.filename];
+
+	checkpointPending += done-input.first;
+	input = std::make_pair( done , (uint64_t)file.size );
+	if ( now || checkpointPending >= CHECKPOINTINTERVAL )
+		save_checkpoint();
+}
+
+void save_checkpoint()
+{
+	std::string tempname = checkpointFilename+".tmp";
+	std::ofstream manifest( tempname.c_str() );
+	struct stat st;
+
+	manifest << checkpoint_options() << '\n';
+	for ( unsigned i = 0; i < outputWriters.size(); i++ )
+	{
+		struct sam_writer& w = outputWriters[i];
+		if ( w.filename.empty() )
+			continue;
+		if ( !w.synced || !w.buffer.empty() ) //unchanged outputs keep their size, and stay closed if they are
+		{
+			if ( !open_writer( w ) ) //reopened so what was written while closed is synced too
+				continue;
+			bufferMemoryUsed -= w.buffer.length();
+			sync_writer( w ); //empties the buffer
+			if ( fstat( fileno( w.file ) , &st ) != 0 )
+				continue;
+			w.checkpointSize = st.st_size;
+			w.synced = true;
 		}
+		manifest << "output " << w.checkpointSize << '\t' << w.filename << '\n';
 	}
+	for ( std::map< std::string , std::pair<uint64_t,uint64_t> >::iterator cit = checkpointInputs.begin(); cit != checkpointInputs.end(); ++cit )
+		manifest << "input " << cit->second.first << ' ' << cit->second.second << '\t' << cit->first << '\n';
+	manifest.close();
+	if ( !manifest || rename( tempname.c_str() , checkpointFilename.c_str() ) != 0 ) //replaced whole, never half written
+		std::cout << "PINDEL2SAM_WARNING: Could not write to " << checkpointFilename << std::endl;
+	checkpointPending = 0;
 }
 
-void print_update( int& next )
+void sync_writer( struct sam_writer& w )
 {
-	if ( linenum == 0 )
-		std::cout << "\t\t\tConverting.\n";
-	else if ( linenum >= next )
+	flush_writer( w , false );
+	if ( w.bgzf )
 	{
-		std::cout << "\t\t\tStill converting. At line " << linenum << "." << std::endl;
-		next += UPDATEFREQUENCY;
+		flush_tail( w );
+		bgzf_wait( w );
 	}
+	if ( fflush( w.file ) != 0 || fsync( fileno( w.file ) ) != 0 )
+		std::cout << "PINDEL2SAM_ERROR: Could not write to " << w.filename << std::endl;
 }
 
-void print_header( const struct header& h )
+/* FRAGMENT CACHE */
+uint32_t crc_data( uint32_t crc , const char* data , size_t len )
 {
-	std::cout << h.top << h.custom << h.bottom;
+	for ( size_t done = 0; done < len; ) //crc32 takes at most a uInt at a time
+	{
+		uInt slice = (uInt)std::min( len-done , (size_t)1 << 30 );
+		crc = crc32( crc , (const Bytef*)data+done , slice );
+		done += slice;
+	}
+	return crc;
 }
 
-void print_pindel_fields( const struct pindel_fields& pid )
+bool crc_file( uint32_t& crc , const std::string& filename )
 {
-	std::cout << pid.indelType << '\t' << pid.indelSize << '\t';
-	std::cout << pid.NT_size << pid.NT_sequence << '\t';
-	std::cout << pid.chrID << '\t' << pid.BPLeft_plus_one << '\t';
-	std::cout << pid.NumSupports << '\t' << pid.NumSupSamples << std::endl;
-	print_supports( pid.supports );
+	std::ifstream file( filename.c_str() , std::ios::binary );
+	char buffer[65536];
+
+	if ( !file.good() )
+		return false;
+	while ( file.read( buffer , sizeof( buffer ) ) || file.gcount() > 0 )
+		crc = crc_data( crc , buffer , file.gcount() );
+	return true;
 }
 
-void print_support_with_summary( const struct pindel_fields& pid , int isup )
+void set_cache_settings( const std::string& config , const std::string& fai )
 {
-	std::cout << pid.indelType << '\t' << pid.indelSize << '\t';
-	std::cout << pid.NT_size << pid.NT_sequence << '\t';
-	std::cout << pid.chrID << '\t' << pid.BPLeft_plus_one << '\t';
-	std::cout << pid.NumSupports << '\t' << pid.NumSupSamples << std::endl;
-	print_support_data( pid.supports[isup] );
+	std::ostringstream options;
+
+	options << FRAGMENTVERSION << ' ' << SAMVERSION << ' ' << PINDELVERSION << ' ' << outputFormat << ' ' << sortOutput << ' ' << mergedOutput;
+	for ( std::map< std::string , std::vector< std::pair<int,int> > >::iterator rit = regions.begin(); rit != regions.end(); ++rit )
+	{
+		for ( unsigned s = 0; s < rit->second.size(); s++ )
+			options << ' ' << rit->first << ':' << rit->second[s].first << '-' << rit->second[s].second;
+	}
+	cacheSettings = crc32( 0L , Z_NULL , 0 );
+	crc_file( cacheSettings , config );
+	crc_file( cacheSettings , fai );
+	cacheSettings = crc_data( cacheSettings , options.str().data() , options.str().length() );
+	mkdir( cacheDirectory.c_str() , 0777 ); //may already exist
 }
 
-void print_support_data( const struct support_data& sd )
+void load_fingerprints()
+{
+	std::ifstream table( ( cacheDirectory+FINGERPRINTFILENAME ).c_str() );
+	struct input_fingerprint fp;
+	std::string path;
+
+	while ( table >> fp.size >> fp.mtime >> fp.crc )
+	{
+		table.get(); //tab before the path, which may hold spaces
+		std::getline( table , path );
+		fingerprints[path] = fp;
+	}
+}
+
+void save_fingerprints()
 {
-	std::cout << sd.leftOfIndel << '\t' << sd.readSequence << '\t';
-	std::cout << sd.readBAMsource << '\t' << sd.readBarcode << '\n';
+	std::string filename = cacheDirectory+FINGERPRINTFILENAME, tempname = filename+".tmp";
+	std::ofstream table( tempname.c_str() );
+
+	for ( std::map<std::string,struct input_fingerprint>::iterator fit = fingerprints.begin(); fit != fingerprints.end(); ++fit )
+		table << fit->second.size << ' ' << fit->second.mtime << ' ' << fit->second.crc << '\t' << fit->first << '\n';
+	table.close();
+	if ( !table || rename( tempname.c_str() , filename.c_str() ) != 0 )
+		std::cout << "PINDEL2SAM_WARNING: Could not write to " << filename << std::endl;
 }
 
-void print_supports( const std::vector<struct support_data>& supports )
+std::string fragment_name( const struct pindel_reader& file )
 {
-	int i = 0;
-	while ( i < supports.size() )
+	std::map<std::string,struct input_fingerprint>::iterator fit = fingerprints.find( file.filename );
+	std::ostringstream name;
+	struct stat st;
+
+	if ( stat( file.filename.c_str() , &st ) != 0 )
+		return "";
+	if ( fit == fingerprints.end() || fit->second.size != file.size || fit->second.mtime != st.st_mtime ) //new or touched, checksum it again
 	{
-		print_support_data( supports[i] );
-		i++;
+		struct input_fingerprint& fp = fingerprints[file.filename];
+		fp.size = file.size;
+		fp.mtime = st.st_mtime;
+		fp.crc = crc_data( crc32( 0L , Z_NULL , 0 ) , file.data , file.size );
+		fit = fingerprints.find( file.filename );
+	}
+	name << std::hex << std::setfill( '0' ) << std::setw( 8 ) << cacheSettings << '-' << std::setw( 8 ) << fit->second.crc << '-' << std::dec << file.size << FRAGMENTSUFFIX;
+
+	return cacheDirectory+name.str();
+}
+
+bool check_fragment( const std::string& filename )
+{
+	FILE* fragment;
+	char head[12];
+	bool ok;
+
+	if ( filename.empty() || !( fragment = fopen( filename.c_str() , "rb" ) ) )
+		return false;
+	ok = fread( head , 1 , 12 , fragment ) == 12 && memcmp( head , "P2SF" , 4 ) == 0 &&
+	     get_int32( head+4 ) == FRAGMENTVERSION && get_int32( head+8 ) == (int)outputWriters.size();
+	while ( ok && fread( head , 1 , 4 , fragment ) == 4 && get_int32( head ) >= 0 ) //skip over each block
+	{
+		ok = get_int32( head ) < (int)outputWriters.size() && fread( head , 1 , 8 , fragment ) == 8 &&
+		     fseeko( fragment , (off_t)(uint32_t)get_int32( head )+(off_t)(uint32_t)get_int32( head+4 )*12 , SEEK_CUR ) == 0;
+	}
+	ok = ok && !feof( fragment ) && get_int32( head ) == -1 && fgetc( fragment ) == EOF; //whole, with its end marker
+	fclose( fragment );
+
+	return ok;
+}
+
+bool replay_fragment( struct pindel_reader& file , std::vector<struct record_batch>& batches )
+{
+	FILE* fragment;
+	char head[12];
+	int output;
+	uint32_t length, count;
+	size_t held = 0;
+	struct sort_entry entry;
+
+	if ( !check_fragment( file.fragment ) || !( fragment = fopen( file.fragment.c_str() , "rb" ) ) )
+		return false;
+	std::cout << "\t\t\tReusing cached conversion: " << file.fragment << std::endl;
+	fseeko( fragment , 12 , SEEK_SET );
+	while ( fread( head , 1 , 4 , fragment ) == 4 && ( output = get_int32( head ) ) >= 0 && fread( head , 1 , 8 , fragment ) == 8 )
+	{
+		struct record_batch& batch = batches[output];
+		length = get_int32( head );
+		count = get_int32( head+4 );
+		entry.offset = batch.data.length();
+		for ( uint32_t e = 0; e < count && fread( head , 1 , 12 , fragment ) == 12; e++ ) //records follow each other
+		{
+			entry.key = (uint32_t)get_int32( head ) | (uint64_t)(uint32_t)get_int32( head+4 ) << 32;
+			entry.length = (uint32_t)get_int32( head+8 );
+			batch.entries.push_back( entry );
+			entry.offset += entry.length;
+		}
+		batch.data.resize( batch.data.length()+length );
+		if ( length > 0 && fread( &batch.data[batch.data.length()-length] , 1 , length , fragment ) != length )
+			std::cout << "PINDEL2SAM_ERROR: could not read " << file.fragment << std::endl;
+		held += length;
+		if ( held >= CHUNKSIZE )
+		{
+			commit_batches( batches );
+			held = 0;
+		}
 	}
+	commit_batches( batches );
+	fclose( fragment );
+
+	return true;
 }
 
-void print_sam( const struct sam_fields& sam )
+void begin_fragment( const struct pindel_reader& file )
 {
-	std::cout << sam.QNAME << "\t" << sam.FLAG << "\t" << sam.RNAME << "\t";
-	std::cout << sam.POS << "\t" << sam.MAPQ << "\t" << sam.CIGAR << "\t";
-	std::cout << sam.RNEXT << "\t" << sam.PNEXT << "\t" << sam.TLEN << "\t";
-	std::cout << sam.SEQ << "\t" << sam.QUAL << "\t" << sam.optional << std::endl;
+	std::map< std::string , std::pair<uint64_t,uint64_t> >::const_iterator cit = checkpointInputs.find( file.filename );
+	std::string head = "P2SF";
+
+	if ( file.fragment.empty() || ( cit != checkpointInputs.end() && cit->second.first > 0 ) ) //a resumed file would be recorded in part
+		return;
+	fragmentOut.filename = file.fragment;
+	fragmentOut.file = fopen( ( file.fragment+".tmp" ).c_str() , "wb" );
+	if ( !fragmentOut.file )
+	{
+		std::cout << "PINDEL2SAM_WARNING: could not open " << file.fragment << ".tmp" << std::endl;
+		return;
+	}
+	fragmentOut.batches.assign( outputWriters.size() , record_batch() );
+	fragmentOut.bytes = 0;
+	put_int32( head , FRAGMENTVERSION );
+	put_int32( head , outputWriters.size() );
+	fragmentOut.failed = fwrite( head.data() , 1 , head.length() , fragmentOut.file ) != head.length();
 }
 
-void clear_support_data( struct support_data& sd )
+void record_fragment( const std::vector<struct record_batch>& batches )
 {
-	sd.leftOfIndel = 0;
-	sd.readSequence = "";
-	sd.readBAMsource = "";
-	sd.readBarcode = "";
+	struct sort_entry entry;
+
+	for ( unsigned i = 0; i < batches.size(); i++ )
+	{
+		struct record_batch& held = fragmentOut.batches[i];
+		for ( unsigned e = 0; e < batches[i].entries.size(); e++ )
+		{
+			entry = batches[i].entries[e];
+			entry.offset += held.data.length();
+			held.entries.push_back( entry );
+		}
+		held.data += batches[i].data;
+		fragmentOut.bytes += batches[i].data.length();
+	}
+	if ( fragmentOut.bytes >= CHUNKSIZE )
+		write_fragment_blocks();
 }
 
-void save_header( const struct header& h , std::map<std::string,std::string>& sampleMap )
+void write_fragment_blocks()
 {
-	std::string outname;
-	std::fstream file;
-	for ( std::map<std::string,std::string>::iterator sit = sampleMap.begin(); sit!=sampleMap.end(); ++sit )
+	std::string block;
+
+	for ( unsigned i = 0; i < fragmentOut.batches.size(); i++ )
+	{
+		struct record_batch& held = fragmentOut.batches[i];
+		if ( held.data.empty() )
+			continue;
+		block.clear();
+		put_int32( block , i );
+		put_uint32( block , held.data.length() );
+		put_uint32( block , held.entries.size() );
+		for ( unsigned e = 0; e < held.entries.size(); e++ ) //offsets follow from the lengths
+		{
+			put_uint32( block , (uint32_t)held.entries[e].key );
+			put_uint32( block , (uint32_t)( held.entries[e].key >> 32 ) );
+			put_uint32( block , held.entries[e].length );
+		}
+		if ( fwrite( block.data() , 1 , block.length() , fragmentOut.file ) != block.length() ||
+		     fwrite( held.data.data() , 1 , held.data.length() , fragmentOut.file ) != held.data.length() )
+			fragmentOut.failed = true;
+		held.data.clear();
+		held.entries.clear();
+	}
+	fragmentOut.bytes = 0;
+}
+
+void end_fragment()
+{
+	std::string tempname = fragmentOut.filename+".tmp", end;
+
+	if ( !fragmentOut.file )
+		return;
+	write_fragment_blocks();
+	put_int32( end , -1 );
+	if ( fwrite( end.data() , 1 , end.length() , fragmentOut.file ) != end.length() )
+		fragmentOut.failed = true;
+	if ( fclose( fragmentOut.file ) != 0 || fragmentOut.failed || rename( tempname.c_str() , fragmentOut.filename.c_str() ) != 0 )
+	{
+		std::cout << "PINDEL2SAM_WARNING: Could not write to " << fragmentOut.filename << std::endl;
+		remove( tempname.c_str() );
+	}
+	fragmentOut.file = NULL;
+	std::vector<struct record_batch>().swap( fragmentOut.batches );
+}
+
+/* SORTING */
+uint64_t sort_key( const struct sam_event& ev , const struct sam_fields& sam )
+{
+	uint32_t ref = ( ev.refID < 0 ) ? 0xffffffff : ev.refID;
+	uint32_t pos = (uint32_t)sam.POS ^ 0x80000000; //signed order as unsigned
+
+	return (uint64_t)ref << 32 | pos;
+}
+
+void spill_run( struct sam_writer& w )
+{
+	std::string runname = w.filename+".run"+int2str( w.runs.size() )+".tmp";
+	FILE* run = fopen( runname.c_str() , "wb" );
+	std::string buffer;
+
+	if ( !run )
+	{//Error opening run, keep sorting in memory
+		std::cout << "PINDEL2SAM_ERROR: could not open " << runname << std::endl;
+		return;
+	}
+	std::stable_sort( w.entries.begin() , w.entries.end() ); //stable keeps input order within a position
+	for ( unsigned e = 0; e < w.entries.size(); e++ )
+	{
+		uint64_t key = w.entries[e].key;
+		put_uint32( buffer , (uint32_t)( key >> 32 ) );
+		put_uint32( buffer , (uint32_t)key );
+		put_uint32( buffer , w.entries[e].length );
+		buffer.append( w.records , w.entries[e].offset , w.entries[e].length );
+		if ( buffer.length() >= OUTPUTBUFFERSIZE || e+1 == w.entries.size() )
+		{
+			if ( fwrite( buffer.data() , 1 , buffer.length() , run ) != buffer.length() )
+				std::cout << "PINDEL2SAM_ERROR: Could not write to " << runname << std::endl;
+			buffer.clear();
+		}
+	}
+	fclose( run );
+	w.runs.push_back( runname );
+	release_sort_memory( w ); //the run on disk holds them now
+}
+
+bool read_run_record( FILE* run , uint64_t& key , std::string& rec )
+{
+	unsigned char head[12];
+	uint32_t len;
+
+	if ( fread( head , 1 , 12 , run ) != 12 )
+		return false;
+	key = (uint64_t)( head[0] | head[1] << 8 | head[2] << 16 | (uint32_t)head[3] << 24 ) << 32;
+	key |= (uint32_t)( head[4] | head[5] << 8 | head[6] << 16 | (uint32_t)head[7] << 24 );
+	len = head[8] | head[9] << 8 | head[10] << 16 | (uint32_t)head[11] << 24;
+	rec.resize( len );
+	return len == 0 || fread( &rec[0] , 1 , len , run ) == len;
+}
+
+void release_sort_memory( struct sam_writer& w )
+{
+	pthread_mutex_lock( &finalizeLock ); //outputs are finished in parallel at the end
+	sortMemoryUsed -= w.records.length()+w.entries.size()*sizeof( struct sort_entry );
+	pthread_mutex_unlock( &finalizeLock );
+	std::string().swap( w.records ); //give the memory back
+	std::vector<struct sort_entry>().swap( w.entries );
+}
+
+void merge_runs( struct sam_writer& w , const struct header& h )
+{
+	if ( w.runs.empty() ) //everything fit in memory
+	{
+		std::stable_sort( w.entries.begin() , w.entries.end() );
+		for ( unsigned e = 0; e < w.entries.size(); e++ )
+			write_sorted( w , h , w.entries[e].key , w.records.data()+w.entries[e].offset , w.entries[e].length );
+		release_sort_memory( w ); //all written to the output buffer
+		return;
+	}
+	if ( !w.entries.empty() )
+		spill_run( w );
+
+	std::vector<FILE*> runs( w.runs.size() );
+	std::vector<uint64_t> keys( w.runs.size() );
+	std::vector<std::string> recs( w.runs.size() );
+	std::vector< std::pair<uint64_t,unsigned> > heap; //smallest key, then earliest run, on top
+	for ( unsigned r = 0; r < w.runs.size(); r++ )
+	{
+		runs[r] = fopen( w.runs[r].c_str() , "rb" );
+		if ( !runs[r] )
+			std::cout << "PINDEL2SAM_ERROR: could not open " << w.runs[r] << std::endl;
+		else if ( read_run_record( runs[r] , keys[r] , recs[r] ) )
+			heap.push_back( std::make_pair( keys[r] , r ) );
+	}
+	std::make_heap( heap.begin() , heap.end() , std::greater< std::pair<uint64_t,unsigned> >() );
+	while ( !heap.empty() )
+	{
+		std::pop_heap( heap.begin() , heap.end() , std::greater< std::pair<uint64_t,unsigned> >() );
+		unsigned r = heap.back().second;
+		heap.pop_back();
+		write_sorted( w , h , keys[r] , recs[r].data() , recs[r].length() );
+		if ( read_run_record( runs[r] , keys[r] , recs[r] ) )
+		{
+			heap.push_back( std::make_pair( keys[r] , r ) );
+			std::push_heap( heap.begin() , heap.end() , std::greater< std::pair<uint64_t,unsigned> >() );
+		}
+	}
+	for ( unsigned r = 0; r < w.runs.size(); r++ )
+	{
+		if ( runs[r] )
+			fclose( runs[r] );
+		remove( w.runs[r].c_str() );
+	}
+	w.runs.clear();
+}
+
+void write_sorted( struct sam_writer& w , const struct header& h , uint64_t key , const char* rec , size_t length )
+{
+	if ( shardOutput && (int)( key >> 32 ) != w.shardRef )
+		next_shard( w , h , key >> 32 );
+	w.buffer.append( rec , length );
+	w.shardReads++;
+	if ( w.indexed )
+		index_record( w , rec , length );
+	if ( w.buffer.length() >= OUTPUTBUFFERSIZE )
+		flush_writer( w , false );
+}
+
+void next_shard( struct sam_writer& w , const struct header& h , int ref )
+{
+	finish_shard( w , h );
+	w.shardRef = ref;
+	w.filename = w.shardBase+"."+h.chrOrder[ref]+".sorted."+outputFormat;
+	w.ubase = w.coffset = w.uwritten = 0; //a new stream
+	w.blockAddress.clear();
+	w.blockStart.clear();
+	w.pending.clear();
+	w.index.refs.assign( h.chrOrder.size() , index_ref() );
+	w.index.unplaced = 0;
+	w.buffer = w.header;
+	w.shardReads = 0;
+	w.created = false;
+	open_writer( w );
+}
+
+void finish_shard( struct sam_writer& w , const struct header& h )
+{
+	std::ostringstream line;
+
+	if ( w.shardBase.empty() || w.shardRef < 0 ) //not an output, or nothing written yet
+		return;
+	flush_writer( w , true );
+	if ( w.indexed )
+		save_index( w );
+	pthread_mutex_lock( &fileLock );
+	release_writer( w );
+	pthread_mutex_unlock( &fileLock );
+	line << w.shardBase.substr( outputDirectoryName.length() ) << '\t' << h.chrOrder[w.shardRef] << '\t' << w.filename << '\t' << w.shardReads << '\n';
+	w.shardLines += line.str();
+	w.shardRef = -1;
+}
+
+/* INDEXING */
+void index_record( struct sam_writer& w , const char* rec , size_t length )
+{
+	struct index_pending p;
+	bam_span( rec , p.refID , p.beg , p.end );
+	p.uend = w.ubase+w.buffer.length();
+	p.ubeg = p.uend-length;
+	w.pending.push_back( p );
+}
+
+void index_resolve( struct sam_writer& w )
+{
+	unsigned done = 0;
+	pthread_mutex_lock( &poolLock ); //block addresses are filled in as blocks are written
+	while ( done < w.pending.size() && w.pending[done].uend <= w.uwritten )
+	{
+		struct index_pending& p = w.pending[done++];
+		index_add( w.index , p.refID , p.beg , p.end , virtual_offset( w , p.ubeg ) , virtual_offset( w , p.uend ) );
+	}
+	pthread_mutex_unlock( &poolLock );
+	w.pending.erase( w.pending.begin() , w.pending.begin()+done );
+}
+
+uint64_t virtual_offset( const struct sam_writer& w , uint64_t u )
+{
+	size_t block = std::upper_bound( w.blockStart.begin() , w.blockStart.end() , u )-w.blockStart.begin(); //blocks starting at or before u
+	if ( block-- == 0 )
+		return w.coffset << 16;
+	uint64_t end = ( block+1 < w.blockStart.size() ) ? w.blockStart[block+1] : w.uwritten;
+	if ( u < end || ( u == end && end-w.blockStart[block] < BGZFBLOCKSIZE ) ) //in the block, or at the end of a short one
+		return w.blockAddress[block] << 16 | ( u-w.blockStart[block] );
+	return w.coffset << 16; //end of a full block is the start of the next block to be written
+}
+
+void index_add( struct bam_index& idx , int refID , int beg , int end , uint64_t vbeg , uint64_t vend )
+{
+	if ( refID < 0 || refID >= (int)idx.refs.size() )
+	{
+		idx.unplaced++;
+		return;
+	}
+	struct index_ref& ref = idx.refs[refID];
+	if ( ref.mapped++ == 0 )
+		ref.first = vbeg;
+	ref.last = vend;
+
+	std::vector< std::pair<uint64_t,uint64_t> >& chunks = ref.bins[reg2bin( beg , end , INDEXMINSHIFT , idx.levels )];
+	if ( !chunks.empty() && chunks.back().second >> 16 == vbeg >> 16 ) //continues in the same block
+		chunks.back().second = vend;
+	else
+		chunks.push_back( std::make_pair( vbeg , vend ) );
+
+	if ( beg < 0 )
+		beg = 0;
+	unsigned last = ( end-1 ) >> INDEXMINSHIFT;
+	if ( ref.linear.size() <= last )
+		ref.linear.resize( last+1 , 0 );
+	for ( unsigned win = beg >> INDEXMINSHIFT; win <= last; win++ )
+	{
+		if ( ref.linear[win] == 0 )
+			ref.linear[win] = vbeg;
+	}
+}
+
+void save_index( struct sam_writer& w )
+{
+	bool csi = w.index.levels > BAILEVELS;
+	std::string indexname = w.filename+( csi ? ".csi" : ".bai" );
+	std::string out;
+	uint32_t pseudobin = ( ( 1 << ( 3*w.index.levels+3 ) )-1 )/7+1; //37450 for BAI
+
+	if ( csi )
+	{
+		out += "CSI\1";
+		put_int32( out , INDEXMINSHIFT );
+		put_int32( out , w.index.levels );
+		put_int32( out , 0 ); //no aux data
+	}
+	else
+		out += "BAI\1";
+	put_int32( out , w.index.refs.size() );
+	for ( unsigned r = 0; r < w.index.refs.size(); r++ )
 	{
-		outname = outputDirectoryName+( sit->second )+".sam";
-		file.open( outname.c_str() );
-		if ( file.good() ) //file existed
+		struct index_ref& ref = w.index.refs[r];
+		for ( unsigned win = 1; win < ref.linear.size(); win++ ) //empty windows take the previous offset
 		{
-			std::cout << "PINDEL2SAM_WARNING: File exists: " << outname;
-			std::cout << "\n\tAssuming header present. Will append to existing files.\n";
-			file.close();
+			if ( ref.linear[win] == 0 )
+				ref.linear[win] = ref.linear[win-1];
 		}
-		else //file did not exist
+		put_int32( out , ref.bins.size()+( ref.mapped > 0 ? 1 : 0 ) );
+		for ( std::map< uint32_t , std::vector< std::pair<uint64_t,uint64_t> > >::iterator bit = ref.bins.begin(); bit != ref.bins.end(); ++bit )
 		{
-			file.open( outname.c_str() , std::ios::out );
-			if ( file.is_open() ) //new file
+			put_uint32( out , bit->first );
+			if ( csi ) //smallest offset of any record overlapping the bin
 			{
-				std::cout << "\t\tInitializing output file: " << outname << std::endl;
-				file << h.top << h.custom << h.bottom;
-				file.close();
+				int level = 0;
+				for ( uint32_t first = 0, count = 1; bit->first >= first+count; first += count, count <<= 3 )
+					level++;
+				uint64_t win = (uint64_t)( bit->first - ( ( 1 << 3*level )-1 )/7 ) << ( 3*( w.index.levels-level ) );
+				uint64_t loffset = win < ref.linear.size() ? ref.linear[win] : 0;
+				put_uint32( out , (uint32_t)loffset );
+				put_uint32( out , (uint32_t)( loffset >> 32 ) );
+			}
+			put_int32( out , bit->second.size() );
+			for ( unsigned c = 0; c < bit->second.size(); c++ )
+			{
+				put_uint32( out , (uint32_t)bit->second[c].first );
+				put_uint32( out , (uint32_t)( bit->second[c].first >> 32 ) );
+				put_uint32( out , (uint32_t)bit->second[c].second );
+				put_uint32( out , (uint32_t)( bit->second[c].second >> 32 ) );
 			}
-			else //Error opening file
-				std::cout << "PINDEL2SAM_ERROR: could not open " << outname << std::endl;
 		}
-	}//for each sample
+		if ( ref.mapped > 0 ) //pseudo-bin with reference span and read counts
+		{
+			put_uint32( out , pseudobin );
+			if ( csi )
+				out.append( 8 , '\0' );
+			put_int32( out , 2 );
+			put_uint32( out , (uint32_t)ref.first );
+			put_uint32( out , (uint32_t)( ref.first >> 32 ) );
+			put_uint32( out , (uint32_t)ref.last );
+			put_uint32( out , (uint32_t)( ref.last >> 32 ) );
+			put_uint32( out , (uint32_t)ref.mapped );
+			put_uint32( out , (uint32_t)( ref.mapped >> 32 ) );
+			out.append( 8 , '\0' ); //no unmapped reads
+		}
+		if ( !csi )
+		{
+			put_int32( out , ref.linear.size() );
+			for ( unsigned win = 0; win < ref.linear.size(); win++ )
+			{
+				put_uint32( out , (uint32_t)ref.linear[win] );
+				put_uint32( out , (uint32_t)( ref.linear[win] >> 32 ) );
+			}
+		}
+	}
+	put_uint32( out , (uint32_t)w.index.unplaced );
+	put_uint32( out , (uint32_t)( w.index.unplaced >> 32 ) );
+
+	if ( csi ) //CSI is BGZF compressed
+	{
+		std::string block;
+		for ( size_t done = 0; done < out.length(); done += BGZFBLOCKSIZE )
+			bgzf_block( out.data()+done , std::min( BGZFBLOCKSIZE , out.length()-done ) , block , compressionLevel );
+		bgzf_block( NULL , 0 , block , compressionLevel );
+		out.swap( block );
+	}
+	FILE* file = fopen( indexname.c_str() , "wb" );
+	if ( !file || fwrite( out.data() , 1 , out.length() , file ) != out.length() )
+		std::cout << "PINDEL2SAM_ERROR: Could not write to " << indexname << std::endl;
+	if ( file )
+		fclose( file );
+}
+
+/* BAM ENCODING */
+void put_int32( std::string& out , int32_t v )
+{
+	put_uint32( out , (uint32_t)v );
+}
+
+void put_uint32( std::string& out , uint32_t v )
+{
+	out += (char)( v & 0xff );
+	out += (char)( ( v >> 8 ) & 0xff );
+	out += (char)( ( v >> 16 ) & 0xff );
+	out += (char)( ( v >> 24 ) & 0xff );
+}
+
+void put_uint16( std::string& out , uint16_t v )
+{
+	out += (char)( v & 0xff );
+	out += (char)( ( v >> 8 ) & 0xff );
+}
+
+int get_int32( const char* p )
+{
+	const unsigned char* u = (const unsigned char*)p;
+	return (int32_t)( u[0] | u[1] << 8 | u[2] << 16 | (uint32_t)u[3] << 24 );
 }
 
-void save_sam( const struct sam_fields& sam , const std::string& filename )
+int reg2bin( int beg , int end , int minShift , int levels )
 {
-	std::fstream file;
-	std::string outname = outputDirectoryName+filename+".sam";
-	file.open( outname.c_str() , std::ios::out | std::ios::app );
-	
-	if ( file.good() ) //file exists and opened
+	int shift = minShift;
+	int first = ( ( 1 << 3*levels )-1 )/7; //first bin of the deepest level
+	if ( beg < 0 )
+		beg = 0;
+	--end;
+	for ( int level = levels; level > 0; --level , shift += 3 , first -= 1 << 3*level )
 	{
-		file << sam.QNAME << "\t" << sam.FLAG << "\t" << sam.RNAME << "\t";
-		file << sam.POS << "\t" << sam.MAPQ << "\t" << sam.CIGAR << "\t";
-		file << sam.RNEXT << "\t" << sam.PNEXT << "\t" << sam.TLEN << "\t";
-		file << sam.SEQ << "\t" << sam.QUAL << "\t" << sam.optional << std::endl;
-		file.close();
+		if ( beg >> shift == end >> shift )
+			return first + ( beg >> shift );
+	}
+	return 0;
+}
+
+int index_levels( const struct header& h )
+{
+	int64_t maxlen = 0;
+	int levels = 0;
+	for ( unsigned r = 0; r < h.refLen.size(); r++ )
+		maxlen = std::max( maxlen , (int64_t)h.refLen[r] );
+	maxlen += 256; //as samtools does
+	for ( int64_t span = (int64_t)1 << INDEXMINSHIFT; maxlen > span; span <<= 3 )
+		levels++;
+	return std::max( levels , BAILEVELS );
+}
+
+void bam_span( const char* rec , int& refID , int& beg , int& end )
+{
+	int lname = (unsigned char)rec[12];
+	int ncigar = (unsigned char)rec[16] | (unsigned char)rec[17] << 8;
+	int reflen = 0;
+	refID = get_int32( rec+4 );
+	beg = get_int32( rec+8 );
+	for ( int c = 0; c < ncigar; c++ )
+	{
+		uint32_t op = (uint32_t)get_int32( rec+36+lname+4*c );
+		if ( ( 0x18d >> ( op & 0xf ) ) & 1 ) //M D N = X consume reference
+			reflen += op >> 4;
+	}
+	end = beg + ( reflen > 0 ? reflen : 1 );
+}
+
+void bam_header( const struct header& h , std::string& out )
+{
+	std::string text = h.top + h.custom + h.bottom;
+
+	out += "BAM\1";
+	put_int32( out , text.length() );
+	out += text;
+	put_int32( out , h.chrOrder.size() );
+	for ( unsigned r = 0; r < h.chrOrder.size(); r++ )
+	{
+		put_int32( out , h.chrOrder[r].length()+1 );
+		out += h.chrOrder[r];
+		out += '\0';
+		put_int32( out , h.refLen[r] );
+	}
+}
+
+int bam_record( const struct sam_event& ev , const struct sam_fields& sam , std::string& out )
+{
+	int pos = sam.POS-1;
+	int reflen = 0;
+	int lseq = sam.SEQ.len;
+	size_t start = out.length();
+	std::string::size_type code;
+
+	for ( int o = 0; o < sam.CIGARops; o++ )
+	{
+		if ( ( sam.CIGAR[o] & 0xf ) != 1 ) //M and D consume reference
+			reflen += sam.CIGAR[o] >> 4;
+	}
+	if ( sam.QNAME.len > 254 )
+		return 1;
+	put_int32( out , 0 ); //block_size, set below
+	put_int32( out , ev.refID );
+	put_int32( out , pos );
+	out += (char)( sam.QNAME.len+1 );
+	out += (char)SAMMAPQ;
+	put_uint16( out , ev.longReference ? LONGREFERENCEBIN : reg2bin( pos , pos + ( reflen > 0 ? reflen : 1 ) , INDEXMINSHIFT , BAILEVELS ) ); //CSI indexes compute their own bins
+	put_uint16( out , sam.CIGARops );
+	put_uint16( out , SAMFLAG );
+	put_int32( out , lseq );
+	put_int32( out , -1 ); //RNEXT *
+	put_int32( out , -1 ); //PNEXT 0
+	put_int32( out , 0 ); //TLEN
+	out.append( sam.QNAME.ptr , sam.QNAME.len );
+	out += '\0';
+	for ( int o = 0; o < sam.CIGARops; o++ )
+		put_uint32( out , sam.CIGAR[o] );
+	for ( int b = 0; b < lseq; b += 2 )
+	{
+		int hi = ( code = BAMSEQCODES.find( toupper( sam.SEQ.ptr[b] ) ) ) == std::string::npos ? 15 : code;
+		int lo = 0;
+		if ( b+1 < lseq )
+			lo = ( code = BAMSEQCODES.find( toupper( sam.SEQ.ptr[b+1] ) ) ) == std::string::npos ? 15 : code;
+		out += (char)( hi << 4 | lo );
+	}
+	out.append( lseq , (char)0xff ); //QUAL *
+	out += BAMTAG;
+	if ( ev.complex )
+	{
+		out += ",CI:Z:";
+		append_CIGAR( out , sam.CIGAR , sam.CIGARops );
+	}
+	out += '\0';
+	if ( sam.RG.len > 0 )
+	{
+		out += "RGZ";
+		out.append( sam.RG.ptr , sam.RG.len );
+		out += '\0';
+	}
+	uint32_t blocksize = out.length()-start-4;
+	for ( int i = 0; i < 4; i++ )
+		out[start+i] = (char)( ( blocksize >> ( 8*i ) ) & 0xff );
+
+	return 0;
+}
+
+int bgzf_block( const char* data , size_t len , std::string& out , int level )
+{
+	static const char head[16] = { 31 , (char)139 , 8 , 4 , 0 , 0 , 0 , 0 , 0 , (char)255 , 6 , 0 , 'B' , 'C' , 2 , 0 };
+	size_t start = out.length();
+	z_stream zs;
+	int status;
+
+	out.append( head , 16 );
+	out.append( 2 , '\0' ); //BSIZE, set below
+	out.resize( start+18+compressBound( len )+8 );
+	zs.zalloc = Z_NULL;
+	zs.zfree = Z_NULL;
+	zs.opaque = Z_NULL;
+	if ( deflateInit2( &zs , level , Z_DEFLATED , -15 , 8 , Z_DEFAULT_STRATEGY ) != Z_OK )
+		return 1;
+	zs.next_in = (Bytef*)data;
+	zs.avail_in = len;
+	zs.next_out = (Bytef*)&out[start+18];
+	zs.avail_out = out.length()-start-18;
+	status = deflate( &zs , Z_FINISH );
+	deflateEnd( &zs );
+	if ( status != Z_STREAM_END )
+		return 1;
+	out.resize( start+18+zs.total_out );
+	put_uint32( out , crc32( crc32( 0L , Z_NULL , 0 ) , (const Bytef*)data , len ) );
+	put_uint32( out , len );
+	uint16_t bsize = out.length()-start-1;
+	out[start+16] = (char)( bsize & 0xff );
+	out[start+17] = (char)( bsize >> 8 );
+
+	return 0;
+}
+
+/* COMPRESSION THREADS */
+void start_compressors()
+{
+	compressors.resize( numberOfThreads );
+	for ( int t = 0; t < numberOfThreads; t++ )
+		pthread_create( &compressors[t] , NULL , compress_blocks , NULL );
+}
+
+void stop_compressors()
+{
+	pthread_mutex_lock( &poolLock );
+	poolStopping = true;
+	pthread_cond_broadcast( &jobReady );
+	pthread_mutex_unlock( &poolLock );
+	for ( unsigned t = 0; t < compressors.size(); t++ )
+		pthread_join( compressors[t] , NULL );
+	compressors.clear();
+}
+
+void* compress_blocks( void* )
+{
+	struct bgzf_job* job;
+
+	pthread_mutex_lock( &poolLock );
+	while ( true )
+	{
+		while ( jobQueue.empty() && !poolStopping )
+			pthread_cond_wait( &jobReady , &poolLock );
+		if ( jobQueue.empty() )
+			break;
+		job = jobQueue.front();
+		jobQueue.pop_front();
+		pthread_mutex_unlock( &poolLock );
+		if ( bgzf_block( job->data.data() , job->data.length() , job->block , compressionLevel ) != 0 )
+			std::cout << "PINDEL2SAM_ERROR: could not compress block for " << job->writer->filename << std::endl;
+		pthread_mutex_lock( &poolLock );
+		complete_job( job );
+	}
+	pthread_mutex_unlock( &poolLock );
+
+	return NULL;
+}
+
+void bgzf_submit( struct sam_writer& w , const char* data , size_t len )
+{
+	struct bgzf_job* job = new struct bgzf_job;
+	job->writer = &w;
+	job->data.assign( data ? data : "" , len );
+	job->done = false;
+
+	pthread_mutex_lock( &poolLock );
+	w.inflight.push_back( job );
+	jobsOutstanding++;
+	if ( compressors.empty() ) //no threads, compress here
+	{
+		pthread_mutex_unlock( &poolLock );
+		if ( bgzf_block( job->data.data() , len , job->block , compressionLevel ) != 0 )
+			std::cout << "PINDEL2SAM_ERROR: could not compress block for " << w.filename << std::endl;
+		pthread_mutex_lock( &poolLock );
+		complete_job( job );
 	}
 	else
-	{//Error opening file
-		std::cout << "PINDEL2SAM_ERROR: Could not write to " << outname << std::endl;
+	{
+		jobQueue.push_back( job );
+		pthread_cond_signal( &jobReady );
+		while ( jobsOutstanding > JOBSPERTHREAD*(int)compressors.size() ) //bound memory held in blocks
+			pthread_cond_wait( &jobDone , &poolLock );
 	}
+	pthread_mutex_unlock( &poolLock );
 }
 
-void write_files( struct pindel_fields& pid , std::map<std::string,std::string>& sm , std::map<std::string,int>& om )
+void complete_job( struct bgzf_job* job )
 {
-	struct support_data sd;
-	std::vector<struct support_data> sds;
-	std::map<std::string,int>::iterator omit = om.begin();
-	struct sam_fields sam;
-	
-	for ( unsigned sampleIndex = 0; sampleIndex < str2int( pid.NumSupSamples ); sampleIndex++ )
+	job->done = true;
+	drain_writer( *job->writer );
+	pthread_cond_broadcast( &jobDone );
+}
+
+void drain_writer( struct sam_writer& w )
+{
+	std::vector<struct bgzf_job*> ready;
+
+	while ( !w.draining && !w.inflight.empty() && w.inflight.front()->done )
 	{
-		for ( unsigned supportIndex = 0; supportIndex < str2int( pid.NumSupports ); supportIndex++ )
+		w.draining = true; //only one thread writes this output at a time
+		while ( !w.inflight.empty() && w.inflight.front()->done )
+		{
+			ready.push_back( w.inflight.front() );
+			w.inflight.pop_front();
+		}
+		pthread_mutex_unlock( &poolLock );
+		for ( unsigned j = 0; j < ready.size(); j++ )
 		{
-			if ( om[sm[pid.supports[supportIndex].readBAMsource]] == omit->second )
+			if ( !w.file || fwrite( ready[j]->block.data() , 1 , ready[j]->block.length() , w.file ) != ready[j]->block.length() )
+				std::cout << "PINDEL2SAM_ERROR: Could not write to " << w.filename << std::endl;
+		}
+		pthread_mutex_lock( &poolLock );
+		for ( unsigned j = 0; j < ready.size(); j++ )
+		{
+			if ( !ready[j]->data.empty() ) //the EOF block holds no records
 			{
-				field_conversion( pid , supportIndex , sam );
-				if ( sam.CIGAR.length() > 0 )
-					save_sam( sam , sm[pid.supports[supportIndex].readBAMsource] );
-			}//if sample filename match
-		}//for each support
-		++omit; //advance through map
-	}//for each output file
+				w.blockAddress.push_back( w.coffset );
+				w.blockStart.push_back( w.uwritten );
+			}
+			w.coffset += ready[j]->block.length();
+			w.uwritten += ready[j]->data.length();
+			delete ready[j];
+			jobsOutstanding--;
+		}
+		ready.clear();
+		w.draining = false;
+	}
+}
+
+void bgzf_wait( struct sam_writer& w )
+{
+	pthread_mutex_lock( &poolLock );
+	while ( !w.inflight.empty() || w.draining )
+		pthread_cond_wait( &jobDone , &poolLock );
+	pthread_mutex_unlock( &poolLock );
 }